@@ -0,0 +1,66 @@
+//
+// Second order tracking filter estimating a signal and its rate from noisy samples at a possibly varying interval
+//
+
+#ifndef AUTOCYCLE_STABILITY_FIRMWARE_ALPHABETAFILTER_H
+#define AUTOCYCLE_STABILITY_FIRMWARE_ALPHABETAFILTER_H
+
+#include <Arduino.h>
+
+class AlphaBetaFilter {
+public:
+    // Bandwidth in Hz and damping ratio of the equivalent continuous time tracking loop
+    AlphaBetaFilter(float bandwidth, float damping);
+
+    void reset(float value);
+
+    void update(float measurement, float dt);
+
+    float value() const;
+    float rate() const;
+
+private:
+    float k1, k2;       // Continuous time loop gains, scaled by dt for each step
+    float x = 0, dx = 0;
+    bool initialized = false;
+};
+
+
+inline AlphaBetaFilter::AlphaBetaFilter(float bandwidth, float damping) {
+    float w = 2 * (float) PI * bandwidth;
+    k1 = 2 * damping * w;
+    k2 = w * w;
+}
+
+inline void AlphaBetaFilter::reset(float value) {
+    x = value;
+    dx = 0;
+    initialized = true;
+}
+
+inline void AlphaBetaFilter::update(float measurement, float dt) {
+    if (!initialized) {
+        reset(measurement);
+        return;
+    }
+    if (dt <= 0)
+        return;
+
+    // Predict, then correct with gains limited so long steps cannot overshoot the measurement
+    x += dx * dt;
+    float residual = measurement - x;
+    float alpha = min(k1 * dt, 1.0f);
+    float beta = min(k2 * dt, 1.0f / dt);
+    x += alpha * residual;
+    dx += beta * residual;
+}
+
+inline float AlphaBetaFilter::value() const {
+    return x;
+}
+
+inline float AlphaBetaFilter::rate() const {
+    return dx;
+}
+
+#endif //AUTOCYCLE_STABILITY_FIRMWARE_ALPHABETAFILTER_H
@@ -0,0 +1,194 @@
+//
+// Frames with a header are the tag, the data length, the data and a checksum, the low byte of the sum of everything
+// before it. The RPM reply and the PAS write are bare: the data and a checksum seeded with the tag, plus TAG_WRITE for
+// the write. The start message's reply checksum is undocumented, so only its framing is checked.
+//
+
+#include "BafangCodec.h"
+#include <Arduino.h>
+
+static const BafangMessage messages[BAFANG_MESSAGES] = {
+        {TAG_START,    LEN_START,    true,  false, 3, {0x04, 0xB0, 0x05}},
+        {TAG_BASIC,    LEN_BASIC,    true,  true,  0, {}},
+        {TAG_PEDAL,    LEN_PEDAL,    true,  true,  0, {}},
+        {TAG_THROTTLE, LEN_THROTTLE, true,  true,  0, {}},
+        {TAG_PAS_NUM,  LEN_PAS_NUM,  false, true,  0, {}},
+        {TAG_RPM,      LEN_RPM,      false, true,  0, {}},
+};
+
+static_assert(sizeof(BafangStart) == LEN_START, "BafangStart does not match the wire layout");
+static_assert(sizeof(BafangBasic) == LEN_BASIC, "BafangBasic does not match the wire layout");
+static_assert(sizeof(BafangPedal) == LEN_PEDAL, "BafangPedal does not match the wire layout");
+static_assert(sizeof(BafangThrottle) == LEN_THROTTLE, "BafangThrottle does not match the wire layout");
+
+// Bytes in a reply frame, checksum included
+static int frame_length(const BafangMessage &m) {
+    return (m.header ? 2 : 0) + m.length + 1;
+}
+
+BafangCodec::BafangCodec(SerialPort *port) {
+    this->port = port;
+}
+
+const BafangMessage &BafangCodec::message(uint8_t msg) {
+    return messages[msg];
+}
+
+void BafangCodec::request(uint8_t msg) {
+    const BafangMessage &m = messages[msg];
+
+    flush();
+    port->write(TAG_READ);
+    port->write(m.tag);
+    for (int i = 0; i < m.request_len; i++)
+        port->write(m.request[i]);
+
+    parse_msg = msg;
+    parse_count = 0;
+}
+
+uint8_t BafangCodec::poll() {
+    if (parse_count < 0)
+        return BAFANG_PENDING;
+
+    const BafangMessage &m = messages[parse_msg];
+    int total = frame_length(m);
+
+    while (port->available() > 0) {
+        auto b = (uint8_t) port->read();
+
+        if (m.header && parse_count == 0 && b != m.tag) {
+            skipped++;
+            continue;
+        }
+        if (m.header && parse_count == 1 && b != m.length) {
+            // The tag was part of something else, but this byte may be the real one
+            skipped++;
+            if (b != m.tag) {
+                skipped++;
+                parse_count = 0;
+            }
+            continue;
+        }
+
+        frame[parse_count++] = b;
+        if (parse_count < total)
+            continue;
+
+        parse_count = -1;
+        long sum = m.header ? 0 : m.tag;
+        for (int i = 0; i < total - 1; i++)
+            sum += frame[i];
+        if (m.verified && (uint8_t) sum != frame[total - 1]) {
+            checksum_errors++;
+            return BAFANG_CHECKSUM;
+        }
+
+        memcpy(payload, frame + (m.header ? 2 : 0), m.length);
+        return BAFANG_OK;
+    }
+
+    return BAFANG_PENDING;
+}
+
+const uint8_t *BafangCodec::data() const {
+    return payload;
+}
+
+uint8_t BafangCodec::read(uint8_t msg, void *dest) {
+    uint8_t result = BAFANG_TIMEOUT;
+
+    for (int attempt = 0; attempt <= BAFANG_RETRIES; attempt++) {
+        request(msg);
+
+        result = BAFANG_PENDING;
+        unsigned long start = millis();
+        while (result == BAFANG_PENDING && millis() - start <= attemptTime(msg))
+            result = poll();
+
+        if (result == BAFANG_OK) {
+            memcpy(dest, payload, messages[msg].length);
+            return result;
+        }
+        if (result == BAFANG_PENDING) {
+            timeouts++;
+            result = BAFANG_TIMEOUT;
+        }
+    }
+
+    parse_count = -1;
+    return result;
+}
+
+uint8_t BafangCodec::write(uint8_t msg, const void *src) {
+    const BafangMessage &m = messages[msg];
+    auto bytes = (const uint8_t *) src;
+
+    long sum = m.header ? m.tag + m.length : TAG_WRITE + m.tag;
+    for (int i = 0; i < m.length; i++)
+        sum += bytes[i];
+
+    for (int attempt = 0; attempt <= BAFANG_RETRIES; attempt++) {
+        // Bare writes are not acknowledged, so they leave any reply in progress alone
+        if (m.header)
+            flush();
+
+        port->write(TAG_WRITE);
+        port->write(m.tag);
+        if (m.header)
+            port->write(m.length);
+        for (int i = 0; i < m.length; i++)
+            port->write(bytes[i]);
+        port->write((uint8_t) sum);
+
+        if (!m.header)
+            return BAFANG_OK;
+
+        // Wait for the acknowledgement to start, then for the line to go quiet
+        unsigned long start = millis();
+        while (port->available() <= 0 && millis() - start <= attemptTime(msg));
+        if (port->available() <= 0) {
+            timeouts++;
+            continue;
+        }
+
+        unsigned long quiet = millis();
+        while (millis() - quiet <= 3 * BAFANG_BYTE_US / 1000 && millis() - start <= attemptTime(msg)) {
+            if (port->available() > 0) {
+                port->read();
+                quiet = millis();
+            }
+        }
+        return BAFANG_OK;
+    }
+
+    return BAFANG_TIMEOUT;
+}
+
+unsigned long BafangCodec::transactionTime(uint8_t msg) {
+    return (BAFANG_RETRIES + 1) * attemptTime(msg);
+}
+
+unsigned long BafangCodec::attemptTime(uint8_t msg) {
+    // Request or write out and reply or acknowledgement back, whichever is longer, plus the turnaround
+    const BafangMessage &m = messages[msg];
+    return (frame_length(m) + m.request_len + 4) * BAFANG_BYTE_US / 1000 + BAFANG_TURNAROUND_MS;
+}
+
+void BafangCodec::flush() {
+    while (port->available() > 0)
+        port->read();
+    parse_count = -1;
+}
+
+uint32_t BafangCodec::getChecksumErrors() const {
+    return checksum_errors;
+}
+
+uint32_t BafangCodec::getTimeouts() const {
+    return timeouts;
+}
+
+uint32_t BafangCodec::getSkipped() const {
+    return skipped;
+}
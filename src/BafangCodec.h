@@ -0,0 +1,147 @@
+//
+// Framing, checksums and typed messages of the Bafang BBS controller's UART protocol
+//
+
+#ifndef AUTOCYCLE_STABILITY_FIRMWARE_BAFANGCODEC_H
+#define AUTOCYCLE_STABILITY_FIRMWARE_BAFANGCODEC_H
+
+#include "SerialPort.h"
+#include <Arduino.h>
+
+// Command bytes
+#define TAG_READ        0x11
+#define TAG_WRITE       0x16
+
+// Message tags
+#define TAG_START       0x51
+#define TAG_BASIC       0x52
+#define TAG_PEDAL       0x53
+#define TAG_THROTTLE    0x54
+#define TAG_PAS_NUM     0x0B
+#define TAG_RPM         0x20
+
+// Data lengths
+#define LEN_START       16
+#define LEN_BASIC       24
+#define LEN_PEDAL       11
+#define LEN_THROTTLE    6
+#define LEN_PAS_NUM     1
+#define LEN_RPM         2
+
+// Message table indices
+#define BAFANG_START    0
+#define BAFANG_BASIC    1
+#define BAFANG_PEDAL    2
+#define BAFANG_THROTTLE 3
+#define BAFANG_PAS_NUM  4
+#define BAFANG_RPM      5
+#define BAFANG_MESSAGES 6
+
+#define BAFANG_MAX_LEN  LEN_BASIC
+
+// Transaction results
+#define BAFANG_PENDING  0
+#define BAFANG_OK       1
+#define BAFANG_TIMEOUT  2
+#define BAFANG_CHECKSUM 3
+
+#define BAFANG_BYTE_US      8333UL      // One 10-bit frame at 1200 baud
+#define BAFANG_TURNAROUND_MS 50         // Controller's time to start answering
+#define BAFANG_RETRIES      2           // Extra attempts after a timeout or corrupt reply
+
+typedef struct {
+    uint8_t tag;
+    uint8_t length;         // Data bytes
+    bool header;            // Frame carries the tag and length ahead of the data
+    bool verified;          // Reply checksum is known and checked
+    uint8_t request_len;    // Extra bytes following TAG_READ and the tag in a read request
+    uint8_t request[3];
+} BafangMessage;
+
+// Typed message data, laid out as on the wire
+typedef struct {
+    char manufacturer[4];
+    char model[4];
+    char hardware_version[2];
+    char firmware_version[4];
+    uint8_t voltage;                // Voltage code
+    uint8_t max_current;            // A
+} BafangStart;
+
+typedef struct {
+    uint8_t low_battery;            // Cut-off, V
+    uint8_t current_limit;          // A
+    uint8_t assist_current[10];     // Per assist level, % of current_limit
+    uint8_t assist_speed[10];       // Per assist level, % of speed_limit
+    uint8_t wheel_diameter;         // Code
+    uint8_t speed_meter;            // Sensor type and signals per revolution
+} BafangBasic;
+
+typedef struct {
+    uint8_t pedal_type;
+    uint8_t designated_assist;      // Assist level used, 0xFF follows the display
+    uint8_t speed_limit;            // km/h, 0xFF follows the display
+    uint8_t start_current;          // %
+    uint8_t slow_start_mode;
+    uint8_t startup_degree;         // Pedal signals before assist starts
+    uint8_t work_mode;
+    uint8_t time_of_stop;           // 10 ms
+    uint8_t current_decay;
+    uint8_t stop_decay;             // 10 ms
+    uint8_t keep_current;           // %
+} BafangPedal;
+
+typedef struct {
+    uint8_t start_voltage;          // 0.1 V
+    uint8_t end_voltage;            // 0.1 V
+    uint8_t mode;                   // Speed or current
+    uint8_t designated_assist;      // Assist level used, 0xFF follows the display
+    uint8_t speed_limit;            // km/h, 0xFF follows the display
+    uint8_t start_current;          // %
+} BafangThrottle;
+
+class BafangCodec {
+public:
+    explicit BafangCodec(SerialPort *port);
+
+    static const BafangMessage &message(uint8_t msg);
+
+    // Non-blocking read: request() discards stale input and sends the read request, poll() parses whatever has
+    // arrived since and returns BAFANG_PENDING until the reply is complete. A complete reply's data is in data().
+    // Bytes ahead of the expected tag, or a tag followed by the wrong length, are skipped to resynchronize.
+    void request(uint8_t msg);
+    uint8_t poll();
+    const uint8_t *data() const;
+
+    // Blocking transactions, retried up to BAFANG_RETRIES times and bounded by transactionTime(). Read copies the
+    // reply data into dest. Write succeeds once the controller starts acknowledging.
+    uint8_t read(uint8_t msg, void *dest);
+    uint8_t write(uint8_t msg, const void *src);
+
+    // Longest time a blocking transaction on msg may take, ms
+    static unsigned long transactionTime(uint8_t msg);
+
+    // Discard everything received
+    void flush();
+
+    // Count of replies dropped for a bad checksum or timeout, and of bytes skipped to resynchronize
+    uint32_t getChecksumErrors() const;
+    uint32_t getTimeouts() const;
+    uint32_t getSkipped() const;
+
+private:
+    static unsigned long attemptTime(uint8_t msg);
+
+    SerialPort *port;
+
+    // Reply parser
+    uint8_t parse_msg = 0;
+    int parse_count = -1;           // Bytes of the frame received, -1 when idle
+    uint8_t frame[BAFANG_MAX_LEN + 3]{};
+    uint8_t payload[BAFANG_MAX_LEN]{};
+
+    uint32_t checksum_errors = 0, timeouts = 0, skipped = 0;
+};
+
+
+#endif //AUTOCYCLE_STABILITY_FIRMWARE_BAFANGCODEC_H
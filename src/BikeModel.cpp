@@ -11,6 +11,9 @@ BikeModel::BikeModel() {
     float alpha = 1.319;
     float g = 9.81;
 
+    wheelbase = w;
+    steer_tilt = (float) PI / 2 - alpha;
+
     // Rear wheel parameters
     float r_rw = 0.35;                           // Rear wheel radius
     float m_rw = 3.30;                           // Rear wheel mass
@@ -137,3 +140,7 @@ BLA::Matrix<4, 4> BikeModel::kalmanTransitionMatrix(float v, float dt, bool free
 BLA::Matrix<4, 2> BikeModel::kalmanControlsMatrix(float v, float dt, bool free_running) {
     return controlsMatrix(v, free_running) * dt;
 }
+
+float BikeModel::yawRate(float v, float del) const {
+    return v * del * cos(steer_tilt) / wheelbase;
+}
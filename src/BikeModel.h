@@ -19,11 +19,17 @@ public:
     BLA::Matrix<4, 4> kalmanTransitionMatrix(float v, float dt, bool free_running);
     BLA::Matrix<4, 2> kalmanControlsMatrix(float v, float dt, bool free_running);
 
+    // Kinematic yaw rate (rad/s) for speed v and steering angle del, positive to the right as for phi and del
+    float yawRate(float v, float del) const;
+
     BLA::Matrix<2, 2> M;    // Equivalent mass matrix
     BLA::Matrix<2, 2> M_inv;
     BLA::Matrix<2, 2> C1;   // Linear-velocity equivalent damping matrix
     BLA::Matrix<2, 2> K0;   // Constant equivalent stiffness matrix
     BLA::Matrix<2, 2> K2;   // Velocity-squared equivalent stiffness matrix
+
+    float wheelbase;        // m
+    float steer_tilt;       // Steering axis tilt from vertical (rad)
 };
 
 
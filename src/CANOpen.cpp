@@ -5,6 +5,7 @@
 // Guide on using due_can: https://github.com/collin80/due_can/blob/master/howtouse.txt
 
 #include "CANOpen.h"
+#include "Timebase.h"
 #include <due_can.h>
 
 CANOpenDevice::CANOpenDevice(CANRaw *can_line, uint16_t node_id) {
@@ -20,6 +21,7 @@ CANOpenDevice::CANOpenDevice(CANRaw *can_line, uint16_t node_id) {
         tx_pdo_table[i].mappings = new PDOMapping[8];
 
     tx_pdo_buffer = new BytesUnion[PDO_TX_NUM];
+    tx_pdo_time = new uint64_t[PDO_TX_NUM]();
 }
 
 void CANOpenDevice::networkCommand(uint8_t cmd) {
@@ -217,6 +219,9 @@ void CANOpenDevice::configureTxPDO(uint8_t pdo_map_num, uint8_t trans_type, uint
         case 3:
             cob_base = PDO_TX_COB3;
             break;
+        case 4:
+            cob_base = PDO_TX_COB4;
+            break;
         default:
             cob_base = 0x000U;
 
@@ -273,6 +278,7 @@ void CANOpenDevice::update() {
         for (int i = 0; i < PDO_TX_NUM; i++)
             if (incoming.id == tx_pdo_table[i].cob_id) {
                 tx_pdo_buffer[i].value = incoming.data.value;
+                tx_pdo_time[i] = timebase_micros();
                 break;
             }
 
@@ -284,6 +290,10 @@ void CANOpenDevice::readPDO(uint8_t pdo_map_num, BytesUnion &data) {
     data.value = tx_pdo_buffer[pdo_map_num].value;
 }
 
+uint64_t CANOpenDevice::pdoTime(uint8_t pdo_map_num) const {
+    return tx_pdo_time[pdo_map_num];
+}
+
 void CANOpenDevice::writePDO(uint8_t pdo_map_num, const BytesUnion &data) {
     outgoing.id = rx_pdo_table[pdo_map_num].cob_id;
     outgoing.extended = false;
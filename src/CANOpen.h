@@ -56,6 +56,7 @@
 #define PDO_TX_COB1     0x280U
 #define PDO_TX_COB2     0x380U
 #define PDO_TX_COB3     0x480U
+#define PDO_TX_COB4     0x680U      // No predefined COB-ID beyond PDO 3, 0x680-0x6FF is unused by the predefined set
 
 
 // CANOpen PDO Transmission types
@@ -107,11 +108,15 @@ public:
 
     void readPDO(uint8_t pdo_map_num, BytesUnion &data);
 
+    // Timebase time (us) at which the TX PDO was last taken off the bus, 0 if never received
+    uint64_t pdoTime(uint8_t pdo_map_num) const;
+
     void writePDO(uint8_t pdo_map_num, const BytesUnion &data);
 
     void waitForBoot();
 
     BytesUnion *tx_pdo_buffer;
+    uint64_t *tx_pdo_time;
 
 private:
     CANRaw *can_line;
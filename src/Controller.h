@@ -9,6 +9,9 @@ class Controller {
     public:
         virtual float control(float phi, float del, float dphi, float ddel, float phi_r, float del_r, float v, float dt) = 0;
 
+        // Initialize internal state so control output continues from torque u0 when taking over the actuator
+        virtual void transfer(float u0, float phi, float del, float dphi, float ddel, float phi_r, float del_r, float v) {}
+
 };
 
 #endif //AUTOCYCLE_STABILITY_FIRMWARE_CONTROLLER_H
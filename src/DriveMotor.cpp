@@ -3,49 +3,35 @@
 //
 
 #include "DriveMotor.h"
+#include "Timebase.h"
 #include <Arduino.h>
 
 #define DRIVE_MOTOR_VERBOSE
 
+// Codes the controller takes for assist levels 0 to MAX_PAS
+static const uint8_t pas_codes[MAX_PAS + 1] = {0x00, 0x0B, 0x0D, 0x15, 0x17, 0x03};
 
-DriveMotor::DriveMotor(int throttle_pin) {
+
+DriveMotor::DriveMotor(int throttle_pin, SerialPort *port) : codec(port) {
     throttlePin = throttle_pin;
 }
 
 void DriveMotor::start() {
     pinMode(throttlePin, OUTPUT);
 
-    while (Serial1.available()) Serial1.read();
-
-    Serial1.write(TAG_READ);
-    Serial1.write(TAG_START);
-    Serial1.write(0x04);
-    Serial1.write(0xB0);
-    Serial1.write(0x05);
-
-
-    int c = 0;
-    while (c < LEN_START) {
-        if (Serial1.available() > 0) {
-            startBuffer[c] = Serial1.read();
-#ifdef DRIVE_MOTOR_VERBOSE
-            Serial.print(startBuffer[c]);
-            Serial.print(' ');
-#endif
-            c++;
-        }
-    }
-#ifdef DRIVE_MOTOR_VERBOSE
-    Serial.println();
-#endif
+    if (codec.read(BAFANG_START, &info) == BAFANG_OK)
+        print(&info, sizeof info);
+    else
+        Serial.println("Drive controller did not answer.");
 
     storeBasic();
     storePedal();
-    storeThrottle();
+    if (storeThrottle()) {
+        throttleMinV = (float) throttle.start_voltage * 0.1f;
+        throttleMaxV = (float) throttle.end_voltage * 0.1f;
+    }
     setPAS(DEFAULT_PAS);
-
-    throttleMinV = (float) throttleBuffer[3] * 0.1f;
-    throttleMaxV = (float) throttleBuffer[4] * 0.1f;
+    pas_level = DEFAULT_PAS;
 
     delay(200);
 //    programSpeed();
@@ -53,242 +39,206 @@ void DriveMotor::start() {
 
 
 bool DriveMotor::storeBasic() {
-    while (Serial1.available()) Serial1.read();
-    Serial1.write(TAG_READ);
-    Serial1.write(TAG_BASIC);
-
-    int c = 0;
-    while (c < LEN_BASIC + 3) {
-        if (Serial1.available() > 0) {
-            basicBuffer[c] = Serial1.read();
-#ifdef DRIVE_MOTOR_VERBOSE
-            Serial.print(basicBuffer[c]);
-            Serial.print(' ');
-#endif
-            c++;
-        }
-    }
-#ifdef DRIVE_MOTOR_VERBOSE
-    Serial.println();
-#endif
+    speed_state = SPEED_IDLE;
+    if (codec.read(BAFANG_BASIC, &basic) != BAFANG_OK)
+        return false;
 
+    print(&basic, sizeof basic);
     return true;
 }
 
 
 bool DriveMotor::storePedal() {
-    while (Serial1.available()) Serial1.read();
-    Serial1.write(TAG_READ);
-    Serial1.write(TAG_PEDAL);
-
-    int c = 0;
-    while (c < LEN_PEDAL + 3) {
-        if (Serial1.available() > 0) {
-            pedalBuffer[c] = Serial1.read();
-#ifdef DRIVE_MOTOR_VERBOSE
-            Serial.print(pedalBuffer[c]);
-            Serial.print(' ');
-#endif
-            c++;
-        }
-    }
-#ifdef DRIVE_MOTOR_VERBOSE
-    Serial.println();
-#endif
+    speed_state = SPEED_IDLE;
+    if (codec.read(BAFANG_PEDAL, &pedal) != BAFANG_OK)
+        return false;
 
+    print(&pedal, sizeof pedal);
     return true;
 }
 
 bool DriveMotor::storeThrottle() {
-    while (Serial1.available()) Serial1.read();
-    Serial1.write(TAG_READ);
-    Serial1.write(TAG_THROTTLE);
-
-    int c = 0;
-    while (c < LEN_THROTTLE + 3) {
-        if (Serial1.available() > 0) {
-            throttleBuffer[c] = Serial1.read();
-#ifdef DRIVE_MOTOR_VERBOSE
-            Serial.print(throttleBuffer[c]);
-            Serial.print(' ');
-#endif
-            c++;
-        }
-    }
-#ifdef DRIVE_MOTOR_VERBOSE
-    Serial.println();
-#endif
+    speed_state = SPEED_IDLE;
+    if (codec.read(BAFANG_THROTTLE, &throttle) != BAFANG_OK)
+        return false;
 
+    print(&throttle, sizeof throttle);
     return true;
 }
 
-void DriveMotor::programCurrent(int current, int pas) {
-    byte set;
-    if (current >= 0 && current <= 100) {
-        set = (byte) current;
-    } else {
-        return;
-    }
+bool DriveMotor::programCurrent(int current, int pas) {
+    if (current < 0 || current > 100 || pas < 0 || pas > 9)
+        return false;
 
-    basicBuffer[4 + pas] = set;
-    basicBuffer[2 + LEN_BASIC] = checksum(0, 0, 2 + LEN_BASIC, basicBuffer);
+    // Settings are always read back first, so a failed read cannot write zeros over the controller's configuration
+    if (!storeBasic())
+        return false;
+    basic.assist_current[pas] = (uint8_t) current;
+    return codec.write(BAFANG_BASIC, &basic) == BAFANG_OK;
+}
 
-    Serial1.write(TAG_WRITE);
-    Serial1.write(TAG_BASIC);
-    Serial1.write(LEN_BASIC);
+bool DriveMotor::programSpeed() {
+    if (!storeBasic())
+        return false;
+    basic.assist_speed[0] = 0;
+    basic.assist_speed[2] = 13;
+    basic.assist_speed[4] = 26;
+    basic.assist_speed[6] = 40;
+    basic.assist_speed[8] = 53;
+    basic.assist_speed[9] = 66;
+    return codec.write(BAFANG_BASIC, &basic) == BAFANG_OK;
+}
 
-    for (int i = 2; i < 3 + LEN_BASIC; i++) {
-        Serial1.write(basicBuffer[i]);
-    }
-    while (!Serial1.available());
-    while (Serial1.available()) Serial1.read();
+bool DriveMotor::programPAS(int num) {
+    if (!storeThrottle())
+        return false;
+    throttle.designated_assist = num;
+    if (codec.write(BAFANG_THROTTLE, &throttle) != BAFANG_OK)
+        return false;
+
+    if (!storePedal())
+        return false;
+    pedal.designated_assist = num;
+    return codec.write(BAFANG_PEDAL, &pedal) == BAFANG_OK;
 }
 
-void DriveMotor::programSpeed() {
+void DriveMotor::setPAS(int num) {
+    if (num < 0 || num > MAX_PAS)
+        return;
 
-    basicBuffer[14 + 0] = 0;
-    basicBuffer[14 + 2] = 13;
-    basicBuffer[14 + 4] = 26;
-    basicBuffer[14 + 6] = 40;
-    basicBuffer[14 + 8] = 53;
-    basicBuffer[14 + 9] = 66;
-    basicBuffer[2 + LEN_BASIC] = checksum(0, 0, 2 + LEN_BASIC, basicBuffer);
+    codec.write(BAFANG_PAS_NUM, &pas_codes[num]);
+}
+
+const BafangCodec &DriveMotor::getCodec() const {
+    return codec;
+}
 
-    Serial1.write(TAG_WRITE);
-    Serial1.write(TAG_BASIC);
-    Serial1.write(LEN_BASIC);
+void DriveMotor::print(const void *data, int len) {
 #ifdef DRIVE_MOTOR_VERBOSE
-    Serial.print(TAG_WRITE);
-    Serial.print(" ");
-    Serial.print(TAG_BASIC);
-    Serial.print(" ");
-    Serial.print(LEN_BASIC);
-    Serial.print(" ");
+    for (int i = 0; i < len; i++) {
+        Serial.print(((const uint8_t *) data)[i]);
+        Serial.print(' ');
+    }
+    Serial.println();
 #endif
+}
+
+void DriveMotor::setSpeed(float speed) {
+    target_speed = max(speed, 0.0f);
 
+    int pas = target_speed > 0 ? constrain((int) (target_speed * 10 / MAX_SPEED), 1, MAX_PAS) : 0;
+    if (pas != pas_level) {
+        setPAS(pas);
+        pas_level = pas;
+    }
 
-    for (int i = 2; i < 3 + LEN_BASIC; i++) {
-        Serial1.write(basicBuffer[i]);
-#ifdef DRIVE_MOTOR_VERBOSE
-        Serial.print(basicBuffer[i]);
-        Serial.print(" ");
-#endif
+    if (target_speed == 0) {
+        speed_ei = 0;
+        writeThrottle(0);
     }
-    while (!Serial1.available());
-    while (Serial1.available());
 #ifdef DRIVE_MOTOR_VERBOSE
-    Serial.println();
+    Serial.println(pas);
 #endif
 }
 
-void DriveMotor::programPAS(int num) {
-    storeThrottle();
+void DriveMotor::regulate(float v, float dt) {
+    control_elapsed += dt;
+    if (control_elapsed < 1.0f / SPEED_CONTROL_FREQ)
+        return;
+    float t = control_elapsed;
+    control_elapsed = 0;
 
-    throttleBuffer[5] = num;
-    throttleBuffer[2 + LEN_THROTTLE] = checksum(0, 0, 2 + LEN_THROTTLE, throttleBuffer);
+    if (target_speed == 0)
+        return;
 
-    Serial1.write(TAG_WRITE);
-    Serial1.write(TAG_THROTTLE);
-    Serial1.write(LEN_THROTTLE);
+    // The controller's throttle range can reach past what the DAC puts out, and the integrator must stop at the lower
+    float max_v = min(throttleMaxV, DAC_MAX_V);
 
-    for (int i = 2; i < 3 + LEN_THROTTLE; i++) {
-        Serial1.write(throttleBuffer[i]);
-    }
-    delay(1000);
-    while (Serial1.available()) Serial1.read();
+    float e = target_speed - v;
+    float feedforward = throttleMinV + target_speed / MAX_SPEED * (throttleMaxV - throttleMinV);
+    float command = feedforward + SPEED_KP * e + SPEED_KI * speed_ei;
 
-    storePedal();
-    pedalBuffer[3] = num;
-    pedalBuffer[2 + LEN_PEDAL] = checksum(0, 0, 2 + LEN_PEDAL, pedalBuffer);
+    // Integrate only while the throttle can still act on the error, so a saturated throttle does not wind up
+    if ((command < max_v || e < 0) && (command > throttleMinV || e > 0))
+        speed_ei += e * t;
+    command = constrain(command, throttleMinV, max_v);
 
-    Serial1.write(TAG_WRITE);
-    Serial1.write(TAG_PEDAL);
-    Serial1.write(LEN_PEDAL);
+    // The motor does nothing below the minimum voltage, so a stopped throttle starts slewing from there
+    float from = max(throttle_v, throttleMinV);
+    writeThrottle(constrain(command, from - THROTTLE_SLEW * t, from + THROTTLE_SLEW * t));
+}
 
-    for (int i = 2; i < 3 + LEN_PEDAL; i++) {
-        Serial1.write(pedalBuffer[i]);
-    }
-    while (!Serial1.available());
-    while (Serial1.available()) Serial1.read();
+float DriveMotor::getThrottleVoltage() const {
+    return throttle_v;
 }
 
+void DriveMotor::writeThrottle(float voltage) {
+    throttle_v = voltage;
 
-byte DriveMotor::checksum(long prefactor, int from, int to, const byte *arr) {
-    long checksum = prefactor;
-    for (int i = from; i < to; i++)
-        checksum += arr[i];
-    checksum %= 256;
+    float level = 4095.0f * (voltage - DAC_MIN_V) / (DAC_MAX_V - DAC_MIN_V);
+    analogWrite(throttlePin, voltage > 0 ? (uint32_t) constrain(level, 0.0f, 4095.0f) : 0);
+}
+
+void DriveMotor::requestSpeed() {
+    if (speed_state == SPEED_WAITING)
+        return;
 
-    return checksum;
+    speed_retries = 0;
+    sendSpeedRequest();
 }
 
-void DriveMotor::setPAS(int num) {
-    Serial1.write(TAG_WRITE);
-    Serial1.write(TAG_PAS_NUM);
-
-    byte b1 = 0;
-    byte b2 = 0;
-
-    switch (num) {
-        case 0:
-            b1 = 0x00;
-            b2 = 0x21;
-            break;
-        case 1:
-            b1 = 0x0B;
-            b2 = 0x2C;
-            break;
-        case 2:
-            b1 = 0x0D;
-            b2 = 0x2E;
-            break;
-        case 3:
-            b1 = 0x15;
-            b2 = 0x36;
-            break;
-        case 4:
-            b1 = 0x17;
-            b2 = 0x38;
-            break;
-        case 5:
-            b1 = 0x03;
-            b2 = 0x24;
-            break;
-        default:
-            break;
+bool DriveMotor::update() {
+    if (speed_state != SPEED_WAITING)
+        return false;
+
+    uint8_t result = codec.poll();
+
+    if (result == BAFANG_OK) {
+        const uint8_t *reply = codec.data();
+        int rpm = reply[0] * 256 + reply[1];
+        speed = WHEEL_CIRCUMFERENCE * (float) rpm / 60.0f;
+        speed_time = speed_request_stamp;
+        speed_state = SPEED_IDLE;
+        return true;
     }
 
-    Serial1.write(b1);
-    Serial1.write(b2);
+    if (result == BAFANG_CHECKSUM || millis() - speed_request_time > SPEED_TIMEOUT_MS)
+        retrySpeed();
+
+    return false;
 }
 
-void DriveMotor::setSpeed(float speed) {
-    float throttleVoltage = (speed / MIN_SPEED) * (throttleMaxV - throttleMinV) + throttleMinV;
-    unsigned long throttleLevel = min(4095l * (throttleVoltage - DAC_MIN_V) / (DAC_MAX_V - DAC_MIN_V), 4095l);
+bool DriveMotor::speedPending() const {
+    return speed_state == SPEED_WAITING;
+}
 
-    throttleLevel = speed > 0 ? 4095l : 0;
-    Serial.println((int) (speed * 10 / MAX_SPEED));
-    Serial.println(throttleLevel);
+float DriveMotor::getSpeed() const {
+    return speed;
+}
 
-    setPAS((int) (speed * 10 / MAX_SPEED));
+uint64_t DriveMotor::getSpeedTime() const {
+    return speed_time;
+}
 
-    analogWrite(throttlePin, throttleLevel);
+unsigned long DriveMotor::getSpeedFailures() const {
+    return speed_failures;
 }
 
-float DriveMotor::getSpeed() {
-    while (Serial1.available()) Serial1.read();
-    Serial1.write(TAG_READ);
-    Serial1.write(TAG_RPM);
-
-    int c = 0;
-    while (c < 3) {
-        if (Serial1.available() > 0) {
-            startBuffer[c] = Serial1.read();
-            c++;
-        }
-    }
+void DriveMotor::sendSpeedRequest() {
+    codec.request(BAFANG_RPM);
 
-    int rpm = startBuffer[0] * 256 + startBuffer[1];
+    // The controller samples its RPM once the request has been clocked out
+    speed_request_time = millis();
+    speed_request_stamp = timebase_micros() + 2 * BAFANG_BYTE_US;
+    speed_state = SPEED_WAITING;
+}
 
-    return WHEEL_CIRCUMFERENCE * (float) rpm / 60.0;
+void DriveMotor::retrySpeed() {
+    if (speed_retries < SPEED_RETRIES) {
+        speed_retries++;
+        sendSpeedRequest();
+    } else {
+        speed_failures++;
+        speed_state = SPEED_IDLE;
+    }
 }
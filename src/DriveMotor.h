@@ -5,25 +5,19 @@
 #ifndef AUTOCYCLE_STABILITY_FIRMWARE_NEW_DRIVEMOTOR_H
 #define AUTOCYCLE_STABILITY_FIRMWARE_NEW_DRIVEMOTOR_H
 
+#include "BafangCodec.h"
+#include "SerialPort.h"
 #include <Arduino.h>
 
-// Communication constants
-#define TAG_READ        0x11
-#define TAG_WRITE       0x16
+// Asynchronous RPM request states
+#define SPEED_IDLE      0
+#define SPEED_WAITING   1
 
-#define TAG_START       0x51
-#define TAG_BASIC       0x52
-#define TAG_PEDAL       0x53
-#define TAG_THROTTLE    0x54
-#define TAG_PAS_NUM     0x0B
-#define TAG_RPM         0x20
-
-#define LEN_START       19
-#define LEN_BASIC       24
-#define LEN_PEDAL       11
-#define LEN_THROTTLE    6
+#define SPEED_TIMEOUT_MS    100         // Request out and reply back are 5 bytes, about 42 ms
+#define SPEED_RETRIES       2
 
 #define DEFAULT_PAS     5
+#define MAX_PAS         5
 
 #define WHEEL_RADIUS        0.35f                       // meters
 #define WHEEL_CIRCUMFERENCE (2.0f * (float) PI * WHEEL_RADIUS)
@@ -36,37 +30,93 @@
 #define MAX_SPEED       (MAX_RPM * DRIVE_TEETH * WHEEL_CIRCUMFERENCE / REAR_TEETH / 60.0f)
 #define MIN_SPEED       4.2f
 
+// Speed regulation
+#define SPEED_CONTROL_FREQ  20          // Hz
+#define SPEED_KP            0.4f        // Throttle V per m/s of speed error
+#define SPEED_KI            0.2f        // Throttle V per m of integrated speed error
+#define THROTTLE_SLEW       1.5f        // Maximum throttle voltage rate, V/s
+
 class DriveMotor {
 public:
-    explicit DriveMotor(int throttle_pin);
+    // Talks to the controller over port, normally a StreamPort on Serial1 at 1200 baud
+    DriveMotor(int throttle_pin, SerialPort *port);
 
     void start();
 
+    // Read the controller's settings into the typed copies below, each a blocking transaction with a bounded time
+    // budget. Return false if the controller never gave a valid reply.
     bool storeBasic();
     bool storePedal();
     bool storeThrottle();
 
-    void programCurrent(int current, int pas);
-    void programSpeed();
-    void programPAS(int num);
+    // Change and write back settings, returning false if the controller did not acknowledge
+    bool programCurrent(int current, int pas);
+    bool programSpeed();
+    bool programPAS(int num);
 
     void setPAS(int num);
+
+    // Target speed in m/s. The assist level is only reprogrammed when it changes, and zero cuts the throttle at once.
     void setSpeed(float speed);
 
-    float getSpeed();
+    // Drive the throttle toward the target speed from the estimated speed v (m/s). Called every loop with its dt (s),
+    // it runs a PI loop on top of a throttle feedforward at SPEED_CONTROL_FREQ, slewing the throttle by at most
+    // THROTTLE_SLEW.
+    void regulate(float v, float dt);
+
+    float getThrottleVoltage() const;
+
+    // Non-blocking speed: requestSpeed() sends an RPM query and update(), polled every loop, collects the reply as it
+    // arrives. update() returns true when a new reading was accepted. Unanswered or corrupt replies are requested
+    // again up to SPEED_RETRIES times before the query is dropped.
+    void requestSpeed();
+    bool update();
+    bool speedPending() const;
+
+    // Last accepted speed in m/s, the timebase time (us) the controller measured it, and the number of dropped queries
+    float getSpeed() const;
+    uint64_t getSpeedTime() const;
+    unsigned long getSpeedFailures() const;
+
+    const BafangCodec &getCodec() const;
 
 private:
-    static byte checksum(long prefactor, int from, int to, const byte *arr);
+    // Log message data when verbose
+    static void print(const void *data, int len);
+
+    void sendSpeedRequest();
+    void retrySpeed();
+
+    void writeThrottle(float voltage);
 
     float throttleMinV = 1.1;
     float throttleMaxV = 3.5;
 
     int throttlePin = 0;
 
-    byte startBuffer[LEN_START]{};//array to hold responses from controller
-    byte basicBuffer[LEN_BASIC + 3]{};
-    byte pedalBuffer[LEN_PEDAL + 3]{};
-    byte throttleBuffer[LEN_THROTTLE + 3]{};
+    float target_speed = 0;
+    int pas_level = -1;
+    float throttle_v = 0;
+    float speed_ei = 0;
+    float control_elapsed = 0;
+
+    BafangCodec codec;
+
+    // Controller settings as last read
+    BafangStart info{};
+    BafangBasic basic{};
+    BafangPedal pedal{};
+    BafangThrottle throttle{};
+
+    // A blocking transaction discards any pending speed reply, so it leaves the query idle
+    uint8_t speed_state = SPEED_IDLE;
+    uint8_t speed_retries = 0;
+    unsigned long speed_request_time = 0;
+    uint64_t speed_request_stamp = 0;
+
+    float speed = 0;
+    uint64_t speed_time = 0;
+    unsigned long speed_failures = 0;
 };
 
 
@@ -7,6 +7,8 @@
 
 
 #include "IMU.h"
+#include "IMUBus.h"
+#include "Timebase.h"
 
 IMU::IMU(uint8_t addr) {
     this->addr = addr;
@@ -33,30 +35,203 @@ IMU::IMU(uint8_t addr) {
 
     this->fs_sel = 0;
     this->afs_sel = 0;
+
+    setMounting(IMU_MOUNT_ROLL, IMU_MOUNT_PITCH, IMU_MOUNT_YAW);
 }
 
 bool IMU::start() {
     set_register(0x6B, (uint8_t) 0x00); // Set reset and wait
     delay(100);
 
-    return true;
+    uint8_t who_am_i = 0;
+    read_register(0x75, &who_am_i);     // Read WHO_AM_I, the upper six address bits whichever AD0 is
+
+    // Cache the factory offsets, restored as they stand should the device reset
+    int16_t off[3];
+    get_accel_offsets(off[0], off[1], off[2]);
+    get_gyro_offsets(off[0], off[1], off[2]);
+
+    return (who_am_i & 0x7EU) == 0x68U;
 }
 
-bool IMU::configure(uint8_t accel_res, uint8_t gyro_res, uint8_t filtering) {
+float IMU::configure(uint16_t rate_hz, uint16_t bandwidth_hz, uint8_t accel_res, uint8_t gyro_res) {
+    if (rate_hz == 0 || bandwidth_hz == 0 || accel_res > 3 || gyro_res > 3)
+        return -1;
+
+    config_bandwidth = bandwidth_hz;
+
+    // Keep raw unit temperature slopes valid across a change of full scale range
+    if (gyro_fsr && accel_fsr) {
+        for (int i = 0; i < 3; i++) {
+            temp_model.accel_slope[i] *= (float) accel_fsr / (float) ACCEL_FSR[accel_res];
+            temp_model.gyro_slope[i] *= (float) gyro_fsr / (float) GYRO_FSR[gyro_res];
+        }
+    }
+
     this->fs_sel = gyro_res;                // Record FS_SEL and AFS_SEL values, look up FSR for each from table
     this->afs_sel = accel_res;
     this->gyro_fsr = GYRO_FSR[gyro_res];
     this->accel_fsr = ACCEL_FSR[accel_res];
 
-    set_register(0x1A, filtering);      // Set DLPF_CFG (low pass filtering) register
+    // Narrowest filter that still passes the requested bandwidth
+    dlpf_cfg = 0;
+    for (uint8_t i = 0; i < 7; i++)
+        if (DLPF_BW[i] >= bandwidth_hz)
+            dlpf_cfg = i;
+    set_register(0x1A, dlpf_cfg);       // Set DLPF_CFG (low pass filtering) register
 
     // Set FS_SEL and AFS_SEL (gyro & accel resolution) registers
     set_register(0x1B, (uint8_t) (fs_sel << 3U));
     set_register(0x1C, (uint8_t) (afs_sel << 3U));
 
+    // Gyro output rate depends on DLPF_CFG, so the divider follows it
+    set_sample_rate(rate_hz);
+
+    // Drop samples already taken at the old scale or rate
+    if (fifo_enabled)
+        reset_fifo();
+    if (async_enabled)
+        imu_bus_take((int16_t *) samples, FIFO_MAX_SAMPLES);
+    still_n = 0;
+
+    group_delay = DLPF_DELAY[dlpf_cfg] + sample_period / 2;
+    return group_delay;
+}
+
+float IMU::sampleRate() const {
+    return 1 / sample_period;
+}
+
+float IMU::groupDelay() const {
+    return group_delay;
+}
+
+int IMU::accelRange() const {
+    return accel_fsr;
+}
+
+int IMU::gyroRange() const {
+    return gyro_fsr;
+}
+
+float IMU::enableFifo(uint16_t rate_hz) {
+    disableAsync();
+    float rate = set_sample_rate(rate_hz);
+
+    set_register(0x23, (uint8_t) 0xF8); // Set FIFO_EN for temperature, gyro, and accelerometer
+    reset_fifo();
+    fifo_enabled = true;
+
+    return rate;
+}
+
+void IMU::disableFifo() {
+    set_register(0x23, (uint8_t) 0x00);
+    set_register(0x6A, (uint8_t) 0x00); // Clear USER_CTRL FIFO_EN
+    fifo_enabled = false;
+}
+
+float IMU::enableAsync(uint32_t int_pin, uint16_t rate_hz) {
+    disableFifo();
+    float rate = set_sample_rate(rate_hz);
+
+    set_register(0x37, (uint8_t) 0x00); // Set INT_PIN_CFG to active high, push-pull, 50 us pulse
+    set_register(0x38, (uint8_t) 0x01); // Set INT_ENABLE DATA_RDY_EN
+
+    imu_bus_begin_async(addr, 0x3B, FIFO_SAMPLE_BYTES / 2, int_pin);
+    async_enabled = true;
+
+    return rate;
+}
+
+void IMU::disableAsync() {
+    if (!async_enabled)
+        return;
+
+    imu_bus_end_async();
+    set_register(0x38, (uint8_t) 0x00); // Clear INT_ENABLE
+    async_enabled = false;
+}
+
+int IMU::sampleCount() const {
+    return sample_count;
+}
+
+const IMUSample &IMU::sample(int i) const {
+    return samples[i];
+}
+
+uint64_t IMU::sampleTime(int i) const {
+    return sample_time[i];
+}
+
+uint64_t IMU::timestamp() const {
+    return last_sample_time;
+}
+
+void IMU::setTempModel(const IMUTempModel &model) {
+    temp_model = model;
+    temp_model_valid = true;
+}
+
+bool IMU::hasTempModel() const {
+    return temp_model_valid;
+}
+
+void IMU::getTempModel(IMUTempModel &model) const {
+    model = temp_model;
+}
+
+void IMU::setTempCompensation(bool enabled) {
+    temp_compensation = enabled;
+    if (!enabled) {
+        for (int i = 0; i < 3; i++)
+            accel_temp_bias[i] = gyro_temp_bias[i] = 0;
+    }
+}
+
+void IMU::beginTempLearning() {
+    temp_learn_n = 0;
+    temp_learn_t = temp_learn_tt = 0;
+    for (int i = 0; i < 6; i++)
+        temp_learn_x[i] = temp_learn_tx[i] = 0;
+    still_n = 0;                            // Drop the partial bias window, it resumes once learning ends
+    temp_learning = true;
+}
+
+bool IMU::finishTempLearning() {
+    temp_learning = false;
+    if (temp_learn_n < TEMP_LEARN_MIN_SAMP)
+        return false;
+
+    // Least squares slope of each raw axis against temperature, over a span wide enough to resolve it
+    double n = (double) temp_learn_n;
+    double t_var = n * temp_learn_tt - temp_learn_t * temp_learn_t;
+    if (t_var <= n * n * (TEMP_LEARN_MIN_SPAN * TEMP_LEARN_MIN_SPAN / 12))
+        return false;
+
+    float slope[6];
+    for (int i = 0; i < 6; i++)
+        slope[i] = (float) ((n * temp_learn_tx[i] - temp_learn_t * temp_learn_x[i]) / t_var);
+    for (int i = 0; i < 3; i++) {
+        temp_model.accel_slope[i] = slope[i];
+        temp_model.gyro_slope[i] = slope[i + 3];
+    }
+    temp_model_valid = true;
+
     return true;
 }
 
+void IMU::setBiasTracking(bool enabled) {
+    if (enabled && !bias_tracking) {
+        int16_t gx_off, gy_off, gz_off;
+        get_gyro_offsets(gx_off, gy_off, gz_off);   // Refresh the cache once, not on every adjustment
+    }
+    if (!enabled)
+        still_n = 0;
+    bias_tracking = enabled;
+}
+
 bool IMU::calibrateGyroBias() {
     set_gyro_offsets(0, 0, 0);
 
@@ -68,6 +243,7 @@ bool IMU::calibrateGyroBias() {
         update();
         delay(2);
     }
+    temp_model.gyro_temp = temp;            // Offsets hold at this temperature, compensation is zero here
     for (int i = 0; i < CALIB_SAMP; i++) {
         update();
         x_acc += g_x_raw;
@@ -118,6 +294,7 @@ bool IMU::calibrateAccelBias(float x_expected, float y_expected, float z_expecte
         update();
         delay(2);
     }
+    temp_model.accel_temp = temp;           // Offsets hold at this temperature, compensation is zero here
     for (int i = 0; i < CALIB_SAMP; i++) {
         update();
         x_acc += a_x_raw;
@@ -160,28 +337,72 @@ bool IMU::calibrateAccelBias(float x_expected, float y_expected, float z_expecte
            abs(z_acc / CALIB_SAMP) < CALIB_A_TOL;
 }
 
+void IMU::setMounting(float roll, float pitch, float yaw) {
+    float cr = cos(roll), sr = sin(roll);
+    float cp = cos(pitch), sp = sin(pitch);
+    float cy = cos(yaw), sy = sin(yaw);
+
+    // R = Rz(yaw) * Ry(pitch) * Rx(roll)
+    const float r[3][3] = {
+            {cy * cp, cy * sp * sr - sy * cr, cy * sp * cr + sy * sr},
+            {sy * cp, sy * sp * sr + cy * cr, sy * sp * cr - cy * sr},
+            {-sp, cp * sr, cp * cr},
+    };
+    setMounting(r);
+}
+
+void IMU::setMounting(const float r[3][3]) {
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            rotation[i][j] = r[i][j];
+}
+
+void IMU::getMounting(float r[3][3]) const {
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            r[i][j] = rotation[i][j];
+}
+
+void IMU::setLeverArm(float x, float z) {
+    lever_x = x;
+    lever_z = z;
+}
+
+void IMU::getLeverArm(float &x, float &z) const {
+    x = lever_x;
+    z = lever_z;
+}
+
 float IMU::accelX() const {
-    return a_x * cos(rotation) - a_z * sin(rotation) + (gyroZ() * gyroZ()) * IMU_TO_ORIGIN_X;
+    return accel_body[0];
 }
 
 float IMU::accelY() const {
-    return a_y + alphaX * IMU_TO_ORIGIN_Z - alphaZ * IMU_TO_ORIGIN_X;
+    return accel_body[1];
 }
 
 float IMU::accelZ() const {
-    return a_z * cos(rotation) + a_x * sin(rotation) + (gyroX() * gyroX()) * IMU_TO_ORIGIN_Z;
+    return accel_body[2];
 }
 
 float IMU::gyroX() const {
-    return g_x * cos(rotation) - g_z * sin(rotation);
+    return gyro_body[0];
 }
 
 float IMU::gyroY() const {
-    return g_y;
+    return gyro_body[1];
 }
 
 float IMU::gyroZ() const {
-    return g_z * cos(rotation) + g_x * sin(rotation);
+    return gyro_body[2];
+}
+
+float IMU::roll() const {
+    return roll_angle;
+}
+
+float IMU::rollRate() const {
+    return roll_rate;
 }
 
 float IMU::chipTemp() const {
@@ -189,111 +410,451 @@ float IMU::chipTemp() const {
 }
 
 
-void IMU::update() {
-    static unsigned long last_time = 0;
-    float dt = (float) (millis() - last_time) / 1000.0f;
-    last_time = millis();
-
-    int16_t buffer[7];
-    read_registers(0x3B, buffer, 7);
+bool IMU::update() {
+    // Background transfer errors are counted by the bus, so only the device on data ready watches them
+    if (bus_error || (async_enabled && imu_bus_errors() != seen_bus_errors))
+        recover();
+
+    if (async_enabled) {
+        sample_count = imu_bus_take((int16_t *) samples, FIFO_MAX_SAMPLES, sample_time);
+        if (sample_count == 0)
+            return false;
+    } else if (fifo_enabled) {
+        uint64_t now = timebase_micros();
+        if (read_fifo() == 0)
+            return false;
+        auto period_us = (uint64_t) (sample_period * 1e6f);
+        for (int i = 0; i < sample_count; i++)
+            sample_time[i] = now - (uint64_t) (sample_count - 1 - i) * period_us;
+    } else {
+        sample_time[0] = timebase_micros();
+        if (!read_registers(0x3B, (int16_t *) &samples[0], 7))
+            return false;
+        sample_count = 1;
+    }
 
-    a_x_raw = buffer[0];
-    a_y_raw = buffer[1];
-    a_z_raw = buffer[2];
-    temp_raw = buffer[3];
-    g_x_raw = buffer[4];
-    g_y_raw = buffer[5];
-    g_z_raw = buffer[6];
+    // Average the burst, a boxcar anti-aliasing filter ahead of decimation to the loop rate
+    int32_t acc[7] = {};
+    for (int i = 0; i < sample_count; i++) {
+        const int16_t *s = (const int16_t *) &samples[i];
+        for (int j = 0; j < 7; j++)
+            acc[j] += s[j];
+    }
 
-    a_x = GRAV * (float) (a_x_raw * accel_fsr) / ACCEL_RANGE;
-    a_y = GRAV * (float) (a_y_raw * accel_fsr) / ACCEL_RANGE;
-    a_z = GRAV * (float) (a_z_raw * accel_fsr) / ACCEL_RANGE;
+    a_x_raw = acc[0] / sample_count;
+    a_y_raw = acc[1] / sample_count;
+    a_z_raw = acc[2] / sample_count;
+    temp_raw = acc[3] / sample_count;
+    g_x_raw = acc[4] / sample_count;
+    g_y_raw = acc[5] / sample_count;
+    g_z_raw = acc[6] / sample_count;
 
     temp = (float) temp_raw / 340.0f + 36.53f;
-    g_x = (float) (g_x_raw * gyro_fsr) / GYRO_RANGE * (float) PI / 180.0f;
-    g_y = (float) (g_y_raw * gyro_fsr) / GYRO_RANGE * (float) PI / 180.0f;
-    g_z = (float) (g_z_raw * gyro_fsr) / GYRO_RANGE * (float) PI / 180.0f;
 
-    alphaX = ((gyroX() - last_gyro_x)) / dt;
-    alphaZ = ((gyroZ() - last_gyro_z)) / dt;
+    if (temp_learning)
+        learn_temp_model();
+
+    // Bias at this temperature, removed from the averaged reading and from each sample
+    if (temp_compensation) {
+        for (int i = 0; i < 3; i++) {
+            accel_temp_bias[i] = temp_model.accel_slope[i] * (temp - temp_model.accel_temp);
+            gyro_temp_bias[i] = temp_model.gyro_slope[i] * (temp - temp_model.gyro_temp);
+        }
+    }
+
+    a_x = GRAV * ((float) a_x_raw - accel_temp_bias[0]) * (float) accel_fsr / ACCEL_RANGE;
+    a_y = GRAV * ((float) a_y_raw - accel_temp_bias[1]) * (float) accel_fsr / ACCEL_RANGE;
+    a_z = GRAV * ((float) a_z_raw - accel_temp_bias[2]) * (float) accel_fsr / ACCEL_RANGE;
+
+    g_x = ((float) g_x_raw - gyro_temp_bias[0]) * (float) gyro_fsr / GYRO_RANGE * (float) PI / 180.0f;
+    g_y = ((float) g_y_raw - gyro_temp_bias[1]) * (float) gyro_fsr / GYRO_RANGE * (float) PI / 180.0f;
+    g_z = ((float) g_z_raw - gyro_temp_bias[2]) * (float) gyro_fsr / GYRO_RANGE * (float) PI / 180.0f;
+
+    // Rotate into the body frame once, so the getters are plain loads
+    const float a[3] = {a_x, a_y, a_z};
+    const float g[3] = {g_x, g_y, g_z};
+    for (int i = 0; i < 3; i++) {
+        accel_body[i] = rotation[i][0] * a[0] + rotation[i][1] * a[1] + rotation[i][2] * a[2];
+        gyro_body[i] = rotation[i][0] * g[0] + rotation[i][1] * g[1] + rotation[i][2] * g[2];
+    }
+
+    // Centripetal acceleration in the body frame, at the roll from the last update as it changes little in one
+    centripetal_y = centripetal * cosf(roll_angle);
+    centripetal_z = -centripetal * sinf(roll_angle);
+
+    // Track angular acceleration and attitude on every sample, over the time since the one before
+    for (int i = 0; i < sample_count; i++) {
+        float dt = (float) (sample_time[i] - last_sample_time) * 1e-6f;
+        last_sample_time = sample_time[i];
+        process_sample(samples[i], dt <= IMU_MAX_SAMPLE_GAP ? dt : 0);
+    }
+    alphaX = alpha_x_filter.rate();
+    alphaZ = alpha_z_filter.rate();
+
+    if (bias_tracking && !temp_learning && still_n >= BIAS_WINDOW_SAMP) {
+        update_bias();
+        still_n = 0;
+    }
 
-    last_gyro_x = gyroX();
-    last_gyro_z = gyroZ();
+    // Roll from the attitude, roll rate as the Euler angle rate of the bias corrected, burst averaged gyro
+    roll_angle = atan2f(2 * (q[0] * q[1] + q[2] * q[3]), 1 - 2 * (q[1] * q[1] + q[2] * q[2]));
+    float sin_pitch = constrain(2 * (q[0] * q[2] - q[3] * q[1]), -1.0f, 1.0f);
+    float tan_pitch = sin_pitch / max(sqrtf(1 - sin_pitch * sin_pitch), 1e-3f);
+    roll_rate = gyro_body[0] + gyro_correction[0] +
+                tan_pitch * ((gyro_body[1] + gyro_correction[1]) * sinf(roll_angle) +
+                             (gyro_body[2] + gyro_correction[2]) * cosf(roll_angle));
 
+    // Refer accelerations to the origin, removing centripetal and tangential terms of the IMU lever arm
+    accel_body[0] += gyro_body[2] * gyro_body[2] * lever_x;
+    accel_body[1] += alphaX * lever_z - alphaZ * lever_x;
+    accel_body[2] += gyro_body[0] * gyro_body[0] * lever_z;
+
+    return true;
 }
 
 void IMU::set_register(uint8_t reg, uint8_t val) const {
+    imu_bus_lock();
     Wire.beginTransmission(addr);
     Wire.write(reg);
     Wire.write(val);
-    Wire.endTransmission();
+    bus_error |= Wire.endTransmission() != 0;
+    imu_bus_unlock();
 }
 
 void IMU::set_register(uint8_t reg, int16_t val) const {
+    imu_bus_lock();
     Wire.beginTransmission(addr);
     Wire.write(reg);
     Wire.write((uint8_t) (val >> 8));
     Wire.write(val & 0xFF);
-    Wire.endTransmission();
+    bus_error |= Wire.endTransmission() != 0;
+    imu_bus_unlock();
 }
 
 void IMU::read_register(uint8_t reg, uint8_t *val) const {
+    imu_bus_lock();
     Wire.beginTransmission(addr);
     Wire.write(reg);
-    Wire.endTransmission(false);
-    Wire.requestFrom((int) addr, 1, true);
+    bus_error |= Wire.endTransmission(false) != 0;
+    bus_error |= Wire.requestFrom((int) addr, 1, true) != 1;
     *val = Wire.read();
+    imu_bus_unlock();
 }
 
 void IMU::read_register(uint8_t reg, int16_t *val) const {
+    imu_bus_lock();
     Wire.beginTransmission(addr);
     Wire.write(reg);
-    Wire.endTransmission(false);
-    Wire.requestFrom((int) addr, 2, true);
+    bus_error |= Wire.endTransmission(false) != 0;
+    bus_error |= Wire.requestFrom((int) addr, 2, true) != 2;
     *val = Wire.read() << 8U | Wire.read();
+    imu_bus_unlock();
 }
 
 void IMU::read_registers(uint8_t reg, uint8_t *val, int n) const {
+    imu_bus_lock();
     Wire.beginTransmission(addr);
     Wire.write(reg);
-    Wire.endTransmission(false);
-    Wire.requestFrom((int) addr, n, true);
+    bus_error |= Wire.endTransmission(false) != 0;
+    bus_error |= Wire.requestFrom((int) addr, n, true) != n;
 
     for (int i = 0; i < n; i++)
         val[i] = Wire.read();
+    imu_bus_unlock();
 }
 
-void IMU::read_registers(uint8_t reg, int16_t *val, int n) const {
+bool IMU::read_registers(uint8_t reg, int16_t *val, int n) const {
+    imu_bus_lock();
     Wire.beginTransmission(addr);
     Wire.write(reg);
-    Wire.endTransmission(false);
-    Wire.requestFrom((int) addr, 2 * n, true);
+    bool complete = Wire.endTransmission(false) == 0;
+    complete &= Wire.requestFrom((int) addr, 2 * n, true) == 2 * n;
 
     for (int i = 0; i < n; i++)
         val[i] = Wire.read() << 8 | Wire.read();
+    imu_bus_unlock();
+
+    bus_error |= !complete;
+    return complete;
+}
+
+void IMU::recover() {
+    // A failing device would otherwise be recovered on every update, starving the loop
+    if (millis() - last_recovery < IMU_RECOVER_INTERVAL_MS)
+        return;
+    last_recovery = millis();
+
+    // A device that stopped answering leaves the lines free, and clocking the bus would cut into the transfers of
+    // the others
+    if (imu_bus_stuck())
+        imu_bus_recover();
+    seen_bus_errors = imu_bus_errors();
+    bus_error = false;
+
+    // A brown-out resets the device to sleep with default settings, so put back everything that was written
+    uint8_t pwr_mgmt = 0;
+    read_register(0x6B, &pwr_mgmt);     // Read PWR_MGMT_1
+    if (bus_error || !(pwr_mgmt & 0x40U))
+        return;
+
+    set_register(0x6B, (uint8_t) 0x00); // Clear SLEEP
+    configure(config_rate, config_bandwidth, afs_sel, fs_sel);
+    set_accel_offsets(accel_offset[0], accel_offset[1], accel_offset[2]);
+    set_gyro_offsets(gyro_offset[0], gyro_offset[1], gyro_offset[2]);
+    if (fifo_enabled) {
+        set_register(0x23, (uint8_t) 0xF8); // Set FIFO_EN for temperature, gyro, and accelerometer
+        reset_fifo();
+    }
+    if (async_enabled) {
+        set_register(0x37, (uint8_t) 0x00); // Set INT_PIN_CFG to active high, push-pull, 50 us pulse
+        set_register(0x38, (uint8_t) 0x01); // Set INT_ENABLE DATA_RDY_EN
+    }
+}
+
+float IMU::set_sample_rate(uint16_t rate_hz) {
+    config_rate = rate_hz;              // Requested rather than achieved, so a recovery asks for the same
+
+    // Gyro output rate is 8 kHz with the DLPF disabled, 1 kHz otherwise, and is divided by 1 + SMPLRT_DIV
+    float gyro_rate = (dlpf_cfg == 0 || dlpf_cfg == 7) ? 8000.0f : 1000.0f;
+    uint8_t divider = (uint8_t) constrain((int) (gyro_rate / (float) rate_hz + 0.5f) - 1, 0, 255);
+
+    // Every sample crosses the bus, so the rate is held to what it can carry at its clock
+    auto max_rate = (float) imu_bus_max_rate(FIFO_SAMPLE_BYTES);
+    while (divider < 255 && gyro_rate / (float) (1 + divider) > max_rate)
+        divider++;
+    set_register(0x19, divider);        // Set SMPLRT_DIV (sample rate divider) register
+
+    sample_period = (float) (1 + divider) / gyro_rate;
+    return gyro_rate / (float) (1 + divider);
+}
+
+void IMU::reset_fifo() const {
+    set_register(0x6A, (uint8_t) 0x04);     // Set USER_CTRL FIFO_RESET, clears FIFO contents
+    set_register(0x6A, (uint8_t) 0x40);     // Set USER_CTRL FIFO_EN
+}
+
+int IMU::read_fifo() {
+    int16_t count;
+    read_register(0x72, &count);    // Read FIFO_COUNT
+
+    // On overflow the FIFO holds a partial sample at its head and cannot be realigned, so discard everything
+    if (count > FIFO_MAX_SAMPLES * FIFO_SAMPLE_BYTES) {
+        reset_fifo();
+        sample_count = 0;
+        return 0;
+    }
+
+    // Wire buffers 32 bytes per transfer, so drain whole samples in as few transfers as fit
+    sample_count = count / FIFO_SAMPLE_BYTES;
+    const int per_read = BUFFER_LENGTH / FIFO_SAMPLE_BYTES;
+    for (int i = 0; i < sample_count; i += per_read) {
+        int n = min(per_read, sample_count - i);
+        read_registers(0x74, (int16_t *) &samples[i], n * FIFO_SAMPLE_BYTES / 2);
+    }
+
+    return sample_count;
 }
 
 void IMU::set_gyro_offsets(int16_t gx_off, int16_t gy_off, int16_t gz_off) {
     set_register(0x13, gx_off);     // set XG_OFFS (undocumented X gyro offset, uses FS_SEL units)
     set_register(0x15, gy_off);     // set YG_OFFS (undocumented Y gyro offset, uses FS_SEL units)
     set_register(0x17, gz_off);     // set ZG_OFFS (undocumented Z gyro offset, uses FS_SEL units)
+
+    gyro_offset[0] = gx_off;
+    gyro_offset[1] = gy_off;
+    gyro_offset[2] = gz_off;
 }
 
 void IMU::set_accel_offsets(int16_t ax_off, int16_t ay_off, int16_t az_off) {
     set_register(0x06, ax_off); // set XA_OFFS (undocumented X accelerometer offset, uses 1/2 AFS_SEL units)
     set_register(0x08, ay_off); // set YA_OFFS (undocumented Y accelerometer offset, uses 1/2 AFS_SEL units)
     set_register(0x0A, az_off); // set ZA_OFFS (undocumented Z accelerometer offset, uses 1/2 AFS_SEL units)
+
+    accel_offset[0] = ax_off;
+    accel_offset[1] = ay_off;
+    accel_offset[2] = az_off;
 }
 
 void IMU::get_gyro_offsets(int16_t &gx_off, int16_t &gy_off, int16_t &gz_off) {
     read_register(0x13, (int16_t *) &gx_off);
     read_register(0x15, (int16_t *) &gy_off);
     read_register(0x17, (int16_t *) &gz_off);
+
+    gyro_offset[0] = gx_off;
+    gyro_offset[1] = gy_off;
+    gyro_offset[2] = gz_off;
 }
 
 void IMU::get_accel_offsets(int16_t &ax_off, int16_t &ay_off, int16_t &az_off) {
     read_register(0x06, (int16_t *) &ax_off);
     read_register(0x08, (int16_t *) &ay_off);
     read_register(0x0A, (int16_t *) &az_off);
+
+    accel_offset[0] = ax_off;
+    accel_offset[1] = ay_off;
+    accel_offset[2] = az_off;
+}
+
+void IMU::process_sample(const IMUSample &s, float dt) {
+    const float a_scale = GRAV * (float) accel_fsr / ACCEL_RANGE;
+    const float g_scale = (float) gyro_fsr / GYRO_RANGE * (float) PI / 180.0f;
+    const float as[3] = {(float) s.a_x - accel_temp_bias[0], (float) s.a_y - accel_temp_bias[1],
+                         (float) s.a_z - accel_temp_bias[2]};
+    const float gs[3] = {(float) s.g_x - gyro_temp_bias[0], (float) s.g_y - gyro_temp_bias[1],
+                         (float) s.g_z - gyro_temp_bias[2]};
+
+    float a[3], g[3];
+    for (int i = 0; i < 3; i++) {
+        a[i] = a_scale * (rotation[i][0] * as[0] + rotation[i][1] * as[1] + rotation[i][2] * as[2]);
+        g[i] = g_scale * (rotation[i][0] * gs[0] + rotation[i][1] * gs[1] + rotation[i][2] * gs[2]);
+    }
+
+    // The temperature fit needs the raw gyro to follow the bias, so the offsets stay put while it learns
+    if (bias_tracking && !temp_learning)
+        track_bias(as, gs);
+
+    alpha_x_filter.update(g[0], dt);
+    alpha_z_filter.update(g[2], dt);
+
+    a[0] += g[2] * g[2] * lever_x;
+    a[1] += alpha_x_filter.rate() * lever_z - alpha_z_filter.rate() * lever_x;
+    a[2] += g[0] * g[0] * lever_z;
+
+    update_attitude(a, g, dt);
+}
+
+void IMU::setCentripetal(float a_c) {
+    centripetal = a_c;
+}
+
+void IMU::update_attitude(const float a_meas[3], const float g[3], float dt) {
+    // Gravity alone, g sin(phi) = f_y - a_c cos(phi) and g cos(phi) = f_z + a_c sin(phi)
+    const float a[3] = {a_meas[0], a_meas[1] - centripetal_y, a_meas[2] - centripetal_z};
+    float a_norm = sqrtf(a[0] * a[0] + a[1] * a[1] + a[2] * a[2]);
+
+    // Start level in yaw, aligned with the first gravity reading
+    if (!attitude_initialized) {
+        if (a_norm == 0)
+            return;
+        float r = atan2f(a[1], a[2]) / 2;
+        float p = atan2f(-a[0], sqrtf(a[1] * a[1] + a[2] * a[2])) / 2;
+        q[0] = cosf(r) * cosf(p);
+        q[1] = sinf(r) * cosf(p);
+        q[2] = cosf(r) * sinf(p);
+        q[3] = -sinf(r) * sinf(p);
+        attitude_initialized = true;
+        return;
+    }
+    if (dt <= 0)
+        return;
+
+    float gx = g[0] + gyro_correction[0];
+    float gy = g[1] + gyro_correction[1];
+    float gz = g[2] + gyro_correction[2];
+
+    // Steer the gyro towards the measured gravity direction while the specific force is close to gravity alone
+    if (fabsf(a_norm - GRAV) < MAHONY_ACCEL_GATE * GRAV) {
+        float ax = a[0] / a_norm, ay = a[1] / a_norm, az = a[2] / a_norm;
+
+        // Gravity direction in the body frame predicted by the attitude
+        float vx = 2 * (q[1] * q[3] - q[0] * q[2]);
+        float vy = 2 * (q[0] * q[1] + q[2] * q[3]);
+        float vz = q[0] * q[0] - q[1] * q[1] - q[2] * q[2] + q[3] * q[3];
+
+        float ex = ay * vz - az * vy;
+        float ey = az * vx - ax * vz;
+        float ez = ax * vy - ay * vx;
+
+        gyro_correction[0] += MAHONY_KI * ex * dt;
+        gyro_correction[1] += MAHONY_KI * ey * dt;
+        gyro_correction[2] += MAHONY_KI * ez * dt;
+
+        gx += MAHONY_KP * ex;
+        gy += MAHONY_KP * ey;
+        gz += MAHONY_KP * ez;
+    }
+
+    // Integrate q' = q * (0, w) / 2
+    float h = dt / 2;
+    float q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+    q[0] += (-q1 * gx - q2 * gy - q3 * gz) * h;
+    q[1] += (q0 * gx + q2 * gz - q3 * gy) * h;
+    q[2] += (q0 * gy - q1 * gz + q3 * gx) * h;
+    q[3] += (q0 * gz + q1 * gy - q2 * gx) * h;
+
+    float q_norm = sqrtf(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+    for (float &qi : q)
+        qi /= q_norm;
+}
+
+void IMU::learn_temp_model() {
+    // At rest only, so motion does not leak into the fit
+    float g_scale = (float) gyro_fsr / GYRO_RANGE * (float) PI / 180.0f;
+    float g_mag = g_scale * sqrtf((float) g_x_raw * g_x_raw + (float) g_y_raw * g_y_raw + (float) g_z_raw * g_z_raw);
+    if (g_mag > TEMP_LEARN_GYRO_MAX)
+        return;
+
+    const int16_t x[6] = {a_x_raw, a_y_raw, a_z_raw, g_x_raw, g_y_raw, g_z_raw};
+    temp_learn_n++;
+    temp_learn_t += temp;
+    temp_learn_tt += (double) temp * temp;
+    for (int i = 0; i < 6; i++) {
+        temp_learn_x[i] += x[i];
+        temp_learn_tx[i] += (double) temp * x[i];
+    }
+}
+
+void IMU::track_bias(const float as[3], const float gs[3]) {
+    // Accumulate about the first sample of the window so the variance does not cancel away in float
+    if (still_n == 0) {
+        for (int i = 0; i < 3; i++) {
+            still_ref[i] = as[i];
+            still_ref[i + 3] = gs[i];
+        }
+        for (int i = 0; i < 6; i++)
+            still_sum[i] = still_sq[i] = 0;
+    }
+
+    for (int i = 0; i < 6; i++) {
+        float d = (i < 3 ? as[i] : gs[i - 3]) - still_ref[i];
+        still_sum[i] += d;
+        still_sq[i] += d * d;
+    }
+    still_n++;
 }
 
+void IMU::update_bias() {
+    const float a_lsb = GRAV * (float) accel_fsr / ACCEL_RANGE;
+    const float g_lsb = (float) gyro_fsr / GYRO_RANGE * (float) PI / 180.0f;
+    float n = (float) still_n;
+
+    float mean[6];
+    for (int i = 0; i < 6; i++) {
+        float m = still_sum[i] / n;
+        float var = still_sq[i] / n - m * m;
+        mean[i] = still_ref[i] + m;
+
+        float lsb = i < 3 ? a_lsb : g_lsb;
+        float std_max = i < 3 ? BIAS_STILL_ACCEL_STD : BIAS_STILL_GYRO_STD;
+        if (var * lsb * lsb > std_max * std_max)
+            return;
+    }
+    for (int i = 3; i < 6; i++) {
+        if (fabsf(mean[i]) * g_lsb > BIAS_MAX_GYRO)
+            return;
+    }
+
+    // Move whole LSBs of the estimate into the offsets, carrying the remainder to the next window
+    bool changed = false;
+    for (int i = 0; i < 3; i++) {
+        bias_residual[i] += BIAS_GAIN * mean[i + 3];
+        auto step = (int16_t) bias_residual[i];
+        if (step != 0) {
+            gyro_offset[i] -= step;
+            bias_residual[i] -= step;
+            changed = true;
+        }
+    }
+    if (changed)
+        set_gyro_offsets(gyro_offset[0], gyro_offset[1], gyro_offset[2]);
+}
@@ -15,33 +15,148 @@
 #define GYRO_RANGE      32767
 #define ACCEL_RANGE     32767
 
+// Default position of the sensor behind and above the origin (m)
 #define IMU_TO_ORIGIN_X .62f
 #define IMU_TO_ORIGIN_Z .76f
 
+// Default mounting, sensor pitched 16 degrees relative to the frame
+#define IMU_MOUNT_ROLL  0.0f
+#define IMU_MOUNT_PITCH (-16.0f * (float) PI / 180.0f)
+#define IMU_MOUNT_YAW   0.0f
+
+// Angular acceleration estimator for the lever arm correction
+#define ALPHA_FILTER_BW         10.0f   // Hz
+#define ALPHA_FILTER_DAMPING    0.707f
+
+// Mahony attitude filter, gains in rad/s per unit of gravity direction error
+#define MAHONY_KP               0.5f
+#define MAHONY_KI               0.005f
+#define MAHONY_ACCEL_GATE       0.2f    // Skip the gravity correction when |a| is off g by more than this fraction
+
+// Temperature bias learning, only from readings taken at rest over a useful temperature span
+#define TEMP_LEARN_GYRO_MAX     0.05f   // rad/s
+#define TEMP_LEARN_MIN_SPAN     5.0f    // C
+#define TEMP_LEARN_MIN_SAMP     500
+
+// Online gyro bias tracking, over windows of samples judged at rest from their spread
+#define BIAS_WINDOW_SAMP        500
+#define BIAS_STILL_GYRO_STD     0.01f   // rad/s
+#define BIAS_STILL_ACCEL_STD    0.1f    // m/s^2
+#define BIAS_MAX_GYRO           0.05f   // rad/s, larger window means are motion rather than bias
+#define BIAS_GAIN               0.5f    // Fraction of each at-rest window mean removed from the offsets
+
+#define IMU_RECOVER_INTERVAL_MS 100     // Least time between bus recoveries for one device
+#define IMU_MAX_SAMPLE_GAP      0.1f    // s, longer gaps restart the filters rather than integrate across them
+
+#define FIFO_SIZE           1024
+#define FIFO_SAMPLE_BYTES   14                              // Accelerometer, temperature and gyro, as in 0x3B-0x48
+#define FIFO_MAX_SAMPLES    (FIFO_SIZE / FIFO_SAMPLE_BYTES)
+
+// Raw sample in register order
+typedef struct {
+    int16_t a_x, a_y, a_z;
+    int16_t temp;
+    int16_t g_x, g_y, g_z;
+} IMUSample;
+
+// Linear bias against chip temperature per axis, in raw LSB per degree C, relative to the temperatures at which the
+// offsets were last calibrated
+typedef struct {
+    float accel_slope[3];
+    float gyro_slope[3];
+    float accel_temp;       // C
+    float gyro_temp;        // C
+} IMUTempModel;
+
+#include "AlphaBetaFilter.h"
+
 class IMU {
 public:
     explicit IMU(uint8_t addr);
 
+    // Wake the device, false if it does not answer as an MPU-6050
     bool start();
-    bool configure(uint8_t accel_res, uint8_t gyro_res, uint8_t filtering);
+    // Set the output data rate, the narrowest on-chip low-pass filter passing bandwidth_hz, and the accelerometer and
+    // gyro full scale selections (0-3). Safe to call while streaming, samples taken under the old settings are
+    // dropped. Returns the group delay (s) of the gyro path, filter delay plus half a sample period, or -1 without
+    // changing anything if the rate or bandwidth is zero or a selection is out of range.
+    float configure(uint16_t rate_hz, uint16_t bandwidth_hz, uint8_t accel_res, uint8_t gyro_res);
+
+    float sampleRate() const;       // Hz
+    float groupDelay() const;       // s
+    int accelRange() const;         // +/- g
+    int gyroRange() const;          // +/- deg/s
+
+    // Sample into the on-chip FIFO at a fixed rate, drained in one burst per update(). Readings then report the
+    // average of the burst, an anti-aliased decimation of the full rate stream. Rates are held to what the bus can
+    // read at its clock, see imu_bus_max_rate(). Returns the achieved rate in Hz.
+    float enableFifo(uint16_t rate_hz);
+    void disableFifo();
+
+    // Read each sample as the data ready interrupt on int_pin fires, by PDC transfer in the background. update() then
+    // consumes the samples completed since the last call, averaged as with the FIFO. Returns the achieved rate in Hz.
+    float enableAsync(uint32_t int_pin, uint16_t rate_hz);
+    void disableAsync();
+
+    // Raw samples drained by the last update(), oldest first, with their timebase times (us). Data ready samples carry
+    // the time of their interrupt, FIFO samples are spaced back at the sample period from the time of the drain.
+    int sampleCount() const;
+    const IMUSample &sample(int i) const;
+    uint64_t sampleTime(int i) const;
+
+    // Time (us) of the newest sample behind the current readings
+    uint64_t timestamp() const;
+    // Mounting orientation of the sensor on the frame, as Z-Y-X Euler angles (rad) of the sensor axes in body axes,
+    // or directly as the rotation matrix taking sensor frame vectors to body frame vectors
+    void setMounting(float roll, float pitch, float yaw);
+    void setMounting(const float rotation[3][3]);
+    void getMounting(float rotation[3][3]) const;
+
+    // Position of the sensor relative to the origin, x back and z up (m), for referring accelerations to the origin
+    void setLeverArm(float x, float z);
+    void getLeverArm(float &x, float &z) const;
+
+    // Temperature compensation of the offsets. Learning fits the bias slopes to readings taken at rest between the
+    // begin and finish calls, which should span a warm-up. Finishing fails if the data is too short or too narrow.
+    // A model is held once one is set or a fit succeeds.
+    void setTempModel(const IMUTempModel &model);
+    void getTempModel(IMUTempModel &model) const;
+    bool hasTempModel() const;
+    void setTempCompensation(bool enabled);
+    void beginTempLearning();
+    bool finishTempLearning();
+
+    // Refine the gyro offsets in the background from windows of samples at rest, while enabled. The caller enables
+    // it only when the vehicle is known to be still, the variance test rejects the rest. Tracking pauses while the
+    // temperature model learns.
+    void setBiasTracking(bool enabled);
+
     bool calibrateGyroBias();
     bool calibrateAccelBias(float x_expected, float y_expected, float z_expected);
 
-    // Retrieve corrected accelerometer values in m/s
+    // Retrieve corrected accelerometer values in m/s, in the body frame at the origin
     float accelX() const;
     float accelY() const;
     float accelZ() const;
 
-    // Retrieve corrected gyroscope values in rad/s
+    // Retrieve corrected gyroscope values in rad/s, in the body frame
     float gyroX() const;
     float gyroY() const;
     float gyroZ() const;
 
+    // Lateral acceleration of the vehicle in the level frame (m/s^2), positive to the left, such as v times yaw rate in
+    // a turn. It is removed from the accelerometer before the attitude filter takes gravity from it.
+    void setCentripetal(float a_c);
+
+    // Retrieve roll angle in rad and roll rate in rad/s, from the attitude filter run on every sample
+    float roll() const;
+    float rollRate() const;
+
     // Retrieve chip temperature in degrees Celsius
     float chipTemp() const;
 
-    // Update readings from hardware
-    void update();
+    // Update readings from hardware, false if no new sample was available
+    bool update();
 
     void get_gyro_offsets(int16_t & gx_off, int16_t & gy_off, int16_t & gz_off);
     void get_accel_offsets(int16_t & ax_off, int16_t & ay_off, int16_t & az_off);
@@ -54,19 +169,62 @@ private:
     void read_register(uint8_t reg, uint8_t *val) const;          // Read a single register as byte
     void read_register(uint8_t reg, int16_t *val) const;          // Read two byte register as signed integer
     void read_registers(uint8_t reg, uint8_t val[], int n) const; // Read n single byte registers
-    void read_registers(uint8_t reg, int16_t val[], int n) const; // Read n two byte signed int registers
+    bool read_registers(uint8_t reg, int16_t val[], int n) const; // Read n two byte signed int registers
+    float set_sample_rate(uint16_t rate_hz);
+    void recover();                                                // Free a held bus, reconfigure if the device reset
+    void reset_fifo() const;
+    int read_fifo();                                               // Drain FIFO into samples, returns sample count
+    void process_sample(const IMUSample &s, float dt);             // Per sample angular acceleration and attitude
+    void update_attitude(const float a[3], const float g[3], float dt);
+    void learn_temp_model();
+    void track_bias(const float as[3], const float gs[3]);         // Accumulate a sample into the at-rest window
+    void update_bias();                                            // Test the finished window, adjust the offsets
 
     uint8_t addr;
+    mutable bool bus_error = false;         // A transfer failed or came back short since the last update
+    uint32_t seen_bus_errors = 0;
+    unsigned long last_recovery = 0;
+    uint16_t config_rate = 0, config_bandwidth = 0;
+    int16_t accel_offset[3]{};              // Cached offset registers
+    uint8_t dlpf_cfg = 0;
+    bool fifo_enabled = false;
+    bool async_enabled = false;
+    IMUSample samples[FIFO_MAX_SAMPLES]{};
+    int sample_count = 0;
     int16_t a_x_raw, a_y_raw, a_z_raw;
     int16_t g_x_raw, g_y_raw, g_z_raw;
     int16_t temp_raw;
     float a_x, a_y, a_z;
     float g_x, g_y, g_z;
-    float alphaX, alphaZ;
-    float last_gyro_x = 0;
-    float last_gyro_z = 0;
+    float alphaX = 0, alphaZ = 0;
+    AlphaBetaFilter alpha_x_filter{ALPHA_FILTER_BW, ALPHA_FILTER_DAMPING};
+    AlphaBetaFilter alpha_z_filter{ALPHA_FILTER_BW, ALPHA_FILTER_DAMPING};
+    uint64_t sample_time[FIFO_MAX_SAMPLES]{};
+    uint64_t last_sample_time = 0;
+    float sample_period = 0;                // Interval between streamed samples (s)
+    float group_delay = 0;
     float temp;
-    float rotation = 16.0 *  PI / 180.0f;
+    IMUTempModel temp_model{};
+    bool temp_model_valid = false;
+    bool temp_compensation = false;
+    float accel_temp_bias[3]{}, gyro_temp_bias[3]{};   // Raw LSB, for the current temperature
+    bool temp_learning = false;
+    long temp_learn_n = 0;
+    double temp_learn_t, temp_learn_tt, temp_learn_x[6], temp_learn_tx[6];
+    bool bias_tracking = false;
+    int still_n = 0;
+    float still_ref[6]{}, still_sum[6]{}, still_sq[6]{};    // Raw LSB, accelerometer then gyro, about the first sample
+    float bias_residual[3]{};                               // Estimated bias not yet moved into the offsets, raw LSB
+    int16_t gyro_offset[3]{};                               // Cached offset registers
+    float q[4] = {1, 0, 0, 0};              // Attitude quaternion, body to level frame
+    float gyro_correction[3]{};             // Integral term of the attitude filter, the negated gyro bias
+    bool attitude_initialized = false;
+    float roll_angle = 0, roll_rate = 0;
+    float centripetal = 0;
+    float centripetal_y = 0, centripetal_z = 0;     // In the body frame at the current roll
+    float rotation[3][3]{};                 // Sensor to body frame
+    float lever_x = IMU_TO_ORIGIN_X, lever_z = IMU_TO_ORIGIN_Z;
+    float accel_body[3]{}, gyro_body[3]{};  // Rotated readings, accelerations referred to the origin
 
     // Gyroscope and accelerometer FS_SEL and AFS_SEL register resolution values
     uint8_t fs_sel;
@@ -79,6 +237,11 @@ private:
     // Tables of gyro and accelerometer FSRs corresponding to FS_SEL and AFS_SEL register values (0-3)
     const int GYRO_FSR[4] = {250, 500, 1000, 2000};     // in +/- g
     const int ACCEL_FSR[4] = {2, 4, 8, 16};             // in +/- deg/s
+
+    // Gyro bandwidth and delay for each DLPF_CFG value (0-6), from the register map. Accelerometer figures are
+    // within 0.4 ms of these.
+    const uint16_t DLPF_BW[7] = {256, 188, 98, 42, 20, 10, 5};                          // in Hz
+    const float DLPF_DELAY[7] = {0.98e-3f, 1.9e-3f, 2.8e-3f, 4.8e-3f, 8.3e-3f, 13.4e-3f, 18.6e-3f};    // in s
 };
 
 
@@ -0,0 +1,294 @@
+//
+// The Wire library owns the TWI1 interrupt handler, so transfers are run by the PDC and completed either by the next
+// data ready interrupt or by the main loop taking records, whichever comes first. While the PDC clocks in the record
+// the CPU is free. The PDC cannot issue the STOP itself, so once it has filled the record the STOP is requested and
+// the one extra byte the TWI has already started to clock in is discarded. Timeouts run on the cycle counter, which
+// unlike micros() keeps counting while interrupts are masked.
+//
+
+#include "IMUBus.h"
+#include "Timebase.h"
+#include <Arduino.h>
+#include <Wire.h>
+
+#define IMU_BUS_TWI     TWI1
+
+#define STATE_IDLE      0
+#define STATE_BUSY      1
+
+#define IMU_BUS_TIMEOUT_CYCLES  ((uint64_t) IMU_BUS_TIMEOUT_US * TIMEBASE_CYCLES_PER_US)
+
+static volatile bool active = false;
+static volatile bool locked = false;
+static volatile bool pending = false;       // A data ready edge arrived while locked, read on unlock
+static volatile uint8_t state = STATE_IDLE;
+static volatile uint64_t start_time = 0;
+static volatile uint64_t sample_time = 0;
+static volatile uint32_t errors = 0;
+static volatile uint32_t overruns = 0;
+static uint32_t recoveries = 0;
+static uint32_t bus_clock = IMU_BUS_CLOCK;
+
+static uint8_t device_addr, start_reg, record_words;
+static uint32_t data_ready_pin;
+
+static uint8_t rx_buffer[2 * IMU_BUS_MAX_WORDS];
+static int16_t ring[IMU_BUS_RING_LEN][IMU_BUS_MAX_WORDS];
+static uint64_t ring_time[IMU_BUS_RING_LEN];
+static volatile int ring_head = 0;
+static volatile int ring_count = 0;
+
+static void start_transfer() {
+    IMU_BUS_TWI->TWI_PTCR = TWI_PTCR_RXTDIS | TWI_PTCR_TXTDIS;
+
+    IMU_BUS_TWI->TWI_MMR = 0;
+    IMU_BUS_TWI->TWI_MMR = TWI_MMR_DADR(device_addr) | TWI_MMR_MREAD | TWI_MMR_IADRSZ_1_BYTE;
+    IMU_BUS_TWI->TWI_IADR = start_reg;
+
+    IMU_BUS_TWI->TWI_RPR = (uint32_t) rx_buffer;
+    IMU_BUS_TWI->TWI_RCR = 2 * record_words;
+    IMU_BUS_TWI->TWI_PTCR = TWI_PTCR_RXTEN;
+
+    IMU_BUS_TWI->TWI_CR = TWI_CR_START;
+    start_time = timebase_cycles();
+    state = STATE_BUSY;
+}
+
+// Wait for a status flag with a bound, returning false on timeout
+static bool wait_status(uint32_t flag) {
+    uint64_t t = timebase_cycles();
+    while (!(IMU_BUS_TWI->TWI_SR & flag))
+        if (timebase_cycles() - t > IMU_BUS_TIMEOUT_CYCLES)
+            return false;
+    return true;
+}
+
+static void abort_transfer() {
+    IMU_BUS_TWI->TWI_PTCR = TWI_PTCR_RXTDIS | TWI_PTCR_TXTDIS;
+    IMU_BUS_TWI->TWI_CR = TWI_CR_STOP;
+    wait_status(TWI_SR_TXCOMP);
+    (void) IMU_BUS_TWI->TWI_RHR;
+
+    errors++;
+    state = STATE_IDLE;
+}
+
+// Complete the transfer in flight if the PDC is done, returning false if it is still running. Interrupts must be off.
+static bool finish_transfer() {
+    if (state != STATE_BUSY)
+        return true;
+
+    uint32_t status = IMU_BUS_TWI->TWI_SR;
+    if (status & TWI_SR_NACK) {
+        abort_transfer();
+        return true;
+    }
+    if (!(status & TWI_SR_ENDRX)) {
+        if (timebase_cycles() - start_time > IMU_BUS_TIMEOUT_CYCLES) {
+            abort_transfer();
+            return true;
+        }
+        return false;
+    }
+
+    // Terminate the read and drop the byte clocked in after the record
+    IMU_BUS_TWI->TWI_PTCR = TWI_PTCR_RXTDIS;
+    IMU_BUS_TWI->TWI_CR = TWI_CR_STOP;
+    if (wait_status(TWI_SR_RXRDY))
+        (void) IMU_BUS_TWI->TWI_RHR;
+    if (!wait_status(TWI_SR_TXCOMP)) {
+        abort_transfer();
+        return true;
+    }
+
+    int16_t *record = ring[ring_head];
+    for (int i = 0; i < record_words; i++)
+        record[i] = (int16_t) (rx_buffer[2 * i] << 8U | rx_buffer[2 * i + 1]);
+    ring_time[ring_head] = sample_time;
+    ring_head = (ring_head + 1) % IMU_BUS_RING_LEN;
+    if (ring_count < IMU_BUS_RING_LEN)
+        ring_count++;
+    else
+        overruns++;
+
+    state = STATE_IDLE;
+    return true;
+}
+
+static void data_ready_handler() {
+    // The registers hold a sample until the next one replaces it, so a locked bus only defers the read. A second
+    // edge before it, or one with the last transfer still running, loses a sample.
+    if (locked) {
+        if (pending)
+            overruns++;
+        pending = true;
+        sample_time = timebase_micros();
+        return;
+    }
+    if (!finish_transfer()) {
+        overruns++;
+        return;
+    }
+
+    sample_time = timebase_micros();
+    start_transfer();
+}
+
+void imu_bus_begin(uint32_t clock_hz) {
+    bus_clock = clock_hz;
+    Wire.begin();
+    Wire.setClock(bus_clock);
+}
+
+uint32_t imu_bus_max_rate(uint8_t bytes) {
+    return IMU_BUS_MAX_RATE(bus_clock, bytes);
+}
+
+// Drive a line low, or release it to the pull-up, as an open drain output would
+static void release_line(uint32_t pin, bool release) {
+    if (release) {
+        pinMode(pin, INPUT);
+    } else {
+        pinMode(pin, OUTPUT);
+        digitalWrite(pin, LOW);
+    }
+}
+
+bool imu_bus_recover() {
+    bool was_locked = locked;
+    locked = true;
+
+    // Abandon the transfer in flight, the TWI is about to be reset under it
+    noInterrupts();
+    if (state == STATE_BUSY) {
+        IMU_BUS_TWI->TWI_PTCR = TWI_PTCR_RXTDIS | TWI_PTCR_TXTDIS;
+        errors++;
+        state = STATE_IDLE;
+    }
+    interrupts();
+
+    // Take the pins from the TWI and clock out the rest of whatever byte the slave thinks it is sending
+    Wire.end();
+    release_line(PIN_WIRE_SDA, true);
+    release_line(PIN_WIRE_SCL, true);
+    for (int i = 0; i < 9 && digitalRead(PIN_WIRE_SDA) == LOW; i++) {
+        release_line(PIN_WIRE_SCL, false);
+        delayMicroseconds(IMU_BUS_HALF_BIT_US);
+        release_line(PIN_WIRE_SCL, true);
+        delayMicroseconds(IMU_BUS_HALF_BIT_US);
+    }
+
+    // STOP, SDA rising while SCL is high, so every slave is back to waiting for a START
+    release_line(PIN_WIRE_SCL, false);
+    release_line(PIN_WIRE_SDA, false);
+    delayMicroseconds(IMU_BUS_HALF_BIT_US);
+    release_line(PIN_WIRE_SCL, true);
+    delayMicroseconds(IMU_BUS_HALF_BIT_US);
+    release_line(PIN_WIRE_SDA, true);
+    delayMicroseconds(IMU_BUS_HALF_BIT_US);
+
+    bool free = digitalRead(PIN_WIRE_SDA) == HIGH && digitalRead(PIN_WIRE_SCL) == HIGH;
+
+    imu_bus_begin(bus_clock);
+    recoveries++;
+    if (!was_locked)
+        imu_bus_unlock();
+
+    return free;
+}
+
+bool imu_bus_stuck() {
+    // Both lines idle at the pull-ups once the transfer in flight is done
+    bool was_locked = locked;
+    imu_bus_lock();
+    bool stuck = digitalRead(PIN_WIRE_SDA) == LOW || digitalRead(PIN_WIRE_SCL) == LOW;
+    if (!was_locked)
+        imu_bus_unlock();
+
+    return stuck;
+}
+
+uint32_t imu_bus_recoveries() {
+    return recoveries;
+}
+
+void imu_bus_begin_async(uint8_t addr, uint8_t reg, uint8_t words, uint32_t int_pin) {
+    device_addr = addr;
+    start_reg = reg;
+    record_words = min(words, (uint8_t) IMU_BUS_MAX_WORDS);
+    data_ready_pin = int_pin;
+
+    ring_head = 0;
+    ring_count = 0;
+    state = STATE_IDLE;
+    locked = false;
+    pending = false;
+    active = true;
+
+    pinMode(int_pin, INPUT);
+    attachInterrupt(digitalPinToInterrupt(int_pin), data_ready_handler, RISING);
+}
+
+void imu_bus_end_async() {
+    if (!active)
+        return;
+
+    imu_bus_lock();
+    detachInterrupt(digitalPinToInterrupt(data_ready_pin));
+    active = false;
+    locked = false;
+    pending = false;
+}
+
+bool imu_bus_async_active() {
+    return active;
+}
+
+int imu_bus_take(int16_t *dest, int max_records, uint64_t *stamps) {
+    noInterrupts();
+    finish_transfer();
+
+    int n = min(ring_count, max_records);
+    int first = (ring_head - ring_count + IMU_BUS_RING_LEN) % IMU_BUS_RING_LEN;
+    for (int i = 0; i < n; i++) {
+        memcpy(&dest[i * record_words], ring[(first + i) % IMU_BUS_RING_LEN], 2 * record_words);
+        if (stamps)
+            stamps[i] = ring_time[(first + i) % IMU_BUS_RING_LEN];
+    }
+    ring_count = 0;
+    interrupts();
+
+    return n;
+}
+
+void imu_bus_lock() {
+    if (!active)
+        return;
+
+    // No new transfer starts once locked, so the one in flight can be polled in short critical sections
+    locked = true;
+    bool done;
+    do {
+        noInterrupts();
+        done = finish_transfer();
+        interrupts();
+    } while (!done);
+}
+
+void imu_bus_unlock() {
+    noInterrupts();
+    locked = false;
+    if (pending) {
+        pending = false;
+        start_transfer();
+    }
+    interrupts();
+}
+
+uint32_t imu_bus_errors() {
+    return errors;
+}
+
+uint32_t imu_bus_overruns() {
+    return overruns;
+}
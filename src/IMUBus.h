@@ -0,0 +1,63 @@
+//
+// Interrupt driven PDC reads on the TWI1 (Wire) bus, started by an IMU data ready pin
+//
+
+#ifndef AUTOCYCLE_STABILITY_FIRMWARE_IMUBUS_H
+#define AUTOCYCLE_STABILITY_FIRMWARE_IMUBUS_H
+
+#include <Arduino.h>
+
+#define IMU_BUS_MAX_WORDS   8       // Longest record, in two byte big-endian registers
+#define IMU_BUS_RING_LEN    64      // Completed records buffered between takes, outlasting the 40 ms report() stall
+#define IMU_BUS_TIMEOUT_US  2000    // Longest a single record transfer may take
+#define IMU_BUS_CLOCK       400000  // Fast mode, Hz
+#define IMU_BUS_HALF_BIT_US 5       // Half period of the recovery clock, standard mode
+#define IMU_BUS_MAX_LOAD    50      // Percent of the bus time sampling may take, the rest is left to other transfers
+
+// Bit times to read an n byte record: START, address and register, repeated START and address, the data and a STOP
+#define IMU_BUS_RECORD_BITS(n)          (9 * ((n) + 3) + 3)
+// Highest rate (Hz) at which n byte records fit in IMU_BUS_MAX_LOAD of a bus clocked at clock_hz
+#define IMU_BUS_MAX_RATE(clock_hz, n)   ((clock_hz) / 100 * IMU_BUS_MAX_LOAD / IMU_BUS_RECORD_BITS(n))
+
+// Start Wire on the IMU bus at the given clock
+void imu_bus_begin(uint32_t clock_hz = IMU_BUS_CLOCK);
+
+// Highest rate (Hz) the bus can read bytes long records at its current clock
+uint32_t imu_bus_max_rate(uint8_t bytes);
+
+// Free a bus held by a slave stopped mid-byte: clock SCL until it releases SDA, issue a STOP and restart Wire. Any
+// asynchronous transfer in flight is abandoned. Returns false if either line is still held low.
+bool imu_bus_recover();
+
+// Whether SDA or SCL is held low with no transfer in flight, the only state imu_bus_recover() can clear
+bool imu_bus_stuck();
+
+// Count of recoveries run
+uint32_t imu_bus_recoveries();
+
+// Start reading words registers from reg on device addr every time int_pin rises. Wire must already be started.
+void imu_bus_begin_async(uint8_t addr, uint8_t reg, uint8_t words, uint32_t int_pin);
+
+void imu_bus_end_async();
+
+bool imu_bus_async_active();
+
+// Copy up to max_records completed records (words each) into dest, oldest first, returning the number copied. If
+// given, stamps receives the timebase time (us) of each record's data ready edge. Records left longer than the ring
+// holds are overwritten oldest first and counted by imu_bus_overruns().
+int imu_bus_take(int16_t *dest, int max_records, uint64_t *stamps = nullptr);
+
+// Hold off asynchronous transfers, finishing any in flight, while blocking Wire calls use the bus. Interrupts stay
+// enabled while it waits. A sample that became ready while locked is read on unlock.
+void imu_bus_lock();
+
+void imu_bus_unlock();
+
+// Count of transfers that failed from a NACK or timeout
+uint32_t imu_bus_errors();
+
+// Count of samples lost, overwritten in the ring before they were taken or missed while the bus was busy
+uint32_t imu_bus_overruns();
+
+
+#endif //AUTOCYCLE_STABILITY_FIRMWARE_IMUBUS_H
@@ -0,0 +1,242 @@
+//
+// Each device's noise is estimated from the change between its own consecutive readings, not from its residual to
+// the fused value, which would feed back and drive all weight to one device. Motion adds the same change to every
+// device, so the weights stay balanced while the bike moves.
+//
+
+#include "IMUFusion.h"
+#include "Timebase.h"
+#include <Arduino.h>
+
+bool IMUFusion::add(IMU *imu) {
+    if (n >= IMU_FUSION_MAX)
+        return false;
+
+    imus[n] = imu;
+    for (float &v : var[n])
+        v = FUSION_VAR_INIT;
+    n++;
+
+    return true;
+}
+
+int IMUFusion::count() const {
+    return n;
+}
+
+IMU *IMUFusion::device(int i) const {
+    return imus[i];
+}
+
+bool IMUFusion::healthy(int i) const {
+    return live[i];
+}
+
+bool IMUFusion::used(int i) const {
+    return use[i];
+}
+
+void IMUFusion::setBiasTracking(bool enabled) {
+    for (int i = 0; i < n; i++)
+        imus[i]->setBiasTracking(enabled);
+}
+
+void IMUFusion::setCentripetal(float a_c) {
+    for (int i = 0; i < n; i++)
+        imus[i]->setCentripetal(a_c);
+}
+
+void IMUFusion::beginTempLearning() {
+    for (int i = 0; i < n; i++)
+        imus[i]->beginTempLearning();
+}
+
+bool IMUFusion::finishTempLearning() {
+    bool all = true;
+    for (int i = 0; i < n; i++) {
+        if (imus[i]->finishTempLearning())
+            imus[i]->setTempCompensation(true);
+        else
+            all = false;
+    }
+
+    return all;
+}
+
+bool IMUFusion::update() {
+    float x[IMU_FUSION_MAX][FUSION_CHANNELS];
+
+    for (int i = 0; i < n; i++) {
+        IMU *imu = imus[i];
+        bool fresh = imu->update();
+
+        if (fresh) {
+            last_sample[i] = imu->timestamp();
+
+            // A hung device can keep returning its last conversion, which a stale check alone will not see
+            const IMUSample &s = imu->sample(imu->sampleCount() - 1);
+            stuck_count[i] = memcmp(&s, &last_raw[i], sizeof s) == 0 ? stuck_count[i] + 1 : 0;
+            last_raw[i] = s;
+        }
+
+        // Samples can be stamped after a time read before the update, so the age is not taken by subtraction
+        live[i] = last_sample[i] + FUSION_STALE_US > timebase_micros() && stuck_count[i] < FUSION_STUCK_UPDATES;
+        use[i] = live[i] && !saturated(imu);
+
+        read_channels(imu, x[i]);
+        if (fresh) {
+            for (int c = 0; c < FUSION_CHANNELS; c++) {
+                float d = x[i][c] - last_x[i][c];
+                var[i][c] += FUSION_VAR_GAIN * (d * d / 2 - var[i][c]);
+                last_x[i][c] = x[i][c];
+            }
+        }
+    }
+
+    vote(x);
+
+    // Inverse variance average per channel over the devices that passed
+    bool any = false;
+    for (int c = 0; c < FUSION_CHANNELS; c++) {
+        float w_sum = 0, wx_sum = 0;
+        for (int i = 0; i < n; i++) {
+            if (!use[i])
+                continue;
+            float w = 1 / (var[i][c] + FUSION_VAR_MIN);
+            w_sum += w;
+            wx_sum += w * x[i][c];
+        }
+        if (w_sum > 0) {
+            fused[c] = wx_sum / w_sum;
+            any = true;
+        }
+    }
+
+    for (int i = 0; i < n; i++)
+        if (use[i] && last_sample[i] > fused_time)
+            fused_time = last_sample[i];
+
+    return any;
+}
+
+void IMUFusion::vote(const float x[][FUSION_CHANNELS]) {
+    int m = 0;
+    int idx[IMU_FUSION_MAX];
+    for (int i = 0; i < n; i++)
+        if (use[i])
+            idx[m++] = i;
+    if (m < 2)
+        return;
+
+    for (int c = 3; c < FUSION_CHANNELS; c++) {
+        if (m == 2) {
+            // Two devices can show a fault but not which one has it, so the one in worse condition is dropped
+            int a = idx[0], b = idx[1];
+            float tol = max(FUSION_OUTLIER_SIGMA * sqrtf(var[a][c] + var[b][c]), OUTLIER_MIN[c]);
+            if (fabsf(x[a][c] - x[b][c]) > tol) {
+                int w = worse(a, b, c);
+                if (w >= 0) {
+                    use[w] = false;
+                } else {
+                    use[a] = false;
+                    use[b] = false;
+                }
+                return;
+            }
+            continue;
+        }
+
+        // Median of the voting devices, with m at most IMU_FUSION_MAX an insertion sort is enough
+        float v[IMU_FUSION_MAX];
+        for (int k = 0; k < m; k++) {
+            float xk = x[idx[k]][c];
+            int j = k;
+            for (; j > 0 && v[j - 1] > xk; j--)
+                v[j] = v[j - 1];
+            v[j] = xk;
+        }
+        float median = m % 2 ? v[m / 2] : (v[m / 2 - 1] + v[m / 2]) / 2;
+
+        for (int k = 0; k < m; k++) {
+            int i = idx[k];
+            float tol = max(FUSION_OUTLIER_SIGMA * sqrtf(2 * var[i][c]), OUTLIER_MIN[c]);
+            if (fabsf(x[i][c] - median) > tol)
+                use[i] = false;
+        }
+    }
+}
+
+int IMUFusion::worse(int a, int b, int c) const {
+    // Older samples first, then a device repeating itself, then clearly higher noise on the disputed channel
+    if (last_sample[a] + FUSION_JUDGE_AGE_US < last_sample[b])
+        return a;
+    if (last_sample[b] + FUSION_JUDGE_AGE_US < last_sample[a])
+        return b;
+    if (stuck_count[a] != stuck_count[b])
+        return stuck_count[a] > stuck_count[b] ? a : b;
+    if (var[a][c] > FUSION_JUDGE_VAR_RATIO * var[b][c])
+        return a;
+    if (var[b][c] > FUSION_JUDGE_VAR_RATIO * var[a][c])
+        return b;
+
+    return -1;
+}
+
+void IMUFusion::read_channels(const IMU *imu, float x[FUSION_CHANNELS]) {
+    x[0] = imu->accelX();
+    x[1] = imu->accelY();
+    x[2] = imu->accelZ();
+    x[3] = imu->gyroX();
+    x[4] = imu->gyroY();
+    x[5] = imu->gyroZ();
+    x[6] = imu->roll();
+    x[7] = imu->rollRate();
+}
+
+bool IMUFusion::saturated(const IMU *imu) const {
+    // Any full scale reading in the burst means the average under-reports
+    for (int k = 0; k < imu->sampleCount(); k++) {
+        const IMUSample &s = imu->sample(k);
+        const int16_t axes[6] = {s.a_x, s.a_y, s.a_z, s.g_x, s.g_y, s.g_z};
+        for (int16_t a : axes)
+            if (a >= 32767 || a <= -32768)
+                return true;
+    }
+    return false;
+}
+
+float IMUFusion::accelX() const {
+    return fused[0];
+}
+
+float IMUFusion::accelY() const {
+    return fused[1];
+}
+
+float IMUFusion::accelZ() const {
+    return fused[2];
+}
+
+float IMUFusion::gyroX() const {
+    return fused[3];
+}
+
+float IMUFusion::gyroY() const {
+    return fused[4];
+}
+
+float IMUFusion::gyroZ() const {
+    return fused[5];
+}
+
+float IMUFusion::roll() const {
+    return fused[6];
+}
+
+float IMUFusion::rollRate() const {
+    return fused[7];
+}
+
+uint64_t IMUFusion::timestamp() const {
+    return fused_time;
+}
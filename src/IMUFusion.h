@@ -0,0 +1,83 @@
+//
+// Redundant IMUs on one frame, fused by inverse variance with outlier voting and failover
+//
+
+#ifndef AUTOCYCLE_STABILITY_FIRMWARE_IMUFUSION_H
+#define AUTOCYCLE_STABILITY_FIRMWARE_IMUFUSION_H
+
+#include <Arduino.h>
+#include "IMU.h"
+
+#define IMU_FUSION_MAX          3
+#define FUSION_CHANNELS         8       // Accelerometer x-z, gyro x-z, roll, roll rate
+#define FUSION_VAR_GAIN         0.02f   // Smoothing of each device's noise variance per update
+#define FUSION_VAR_INIT         1e-4f
+#define FUSION_VAR_MIN          1e-8f
+#define FUSION_OUTLIER_SIGMA    4.0f
+#define FUSION_STALE_US         50000UL // Without a new sample for this long a device is failed
+#define FUSION_STUCK_UPDATES    50      // Identical consecutive samples before a device is failed
+#define FUSION_JUDGE_VAR_RATIO  4.0f    // Noise ratio at which the noisier of two disagreeing devices is dropped
+#define FUSION_JUDGE_AGE_US     20000UL // Age gap at which the older of two disagreeing devices is dropped
+
+class IMUFusion {
+public:
+    // Add a started and configured device mounted rigidly on the rear frame, false when full
+    bool add(IMU *imu);
+
+    int count() const;
+    IMU *device(int i) const;
+
+    // Whether the device is delivering live samples, and whether it was used in the last fused reading
+    bool healthy(int i) const;
+    bool used(int i) const;
+
+    // Update all devices and fuse the usable ones, false if none was usable. When two devices disagree and neither
+    // can be told apart as the faulty one, both are set aside and the readings hold their last fused values.
+    bool update();
+
+    void setBiasTracking(bool enabled);
+    void setCentripetal(float a_c);
+
+    // Learn every device's temperature model over the same warm-up. Each device that fits starts compensating, and
+    // finishing returns false if any did not.
+    void beginTempLearning();
+    bool finishTempLearning();
+
+    // Fused readings, in the units and frame of the IMU getters
+    float accelX() const;
+    float accelY() const;
+    float accelZ() const;
+    float gyroX() const;
+    float gyroY() const;
+    float gyroZ() const;
+    float roll() const;
+    float rollRate() const;
+
+    // Time (us) of the newest sample behind the fused readings
+    uint64_t timestamp() const;
+
+private:
+    static void read_channels(const IMU *imu, float x[FUSION_CHANNELS]);
+    bool saturated(const IMU *imu) const;
+    void vote(const float x[][FUSION_CHANNELS]);
+    int worse(int a, int b, int c) const;
+
+    IMU *imus[IMU_FUSION_MAX]{};
+    int n = 0;
+
+    bool live[IMU_FUSION_MAX]{}, use[IMU_FUSION_MAX]{};
+    uint64_t last_sample[IMU_FUSION_MAX]{};
+    IMUSample last_raw[IMU_FUSION_MAX]{};
+    int stuck_count[IMU_FUSION_MAX]{};
+    float last_x[IMU_FUSION_MAX][FUSION_CHANNELS]{};
+    float var[IMU_FUSION_MAX][FUSION_CHANNELS]{};   // Sample to sample noise of each channel
+
+    float fused[FUSION_CHANNELS]{};
+    uint64_t fused_time = 0;
+
+    // Disagreement always tolerated, covering mounting and bias differences, for gyro x-z, roll, roll rate
+    const float OUTLIER_MIN[FUSION_CHANNELS] = {0, 0, 0, 0.2f, 0.2f, 0.2f, 0.05f, 0.2f};
+};
+
+
+#endif //AUTOCYCLE_STABILITY_FIRMWARE_IMUFUSION_H
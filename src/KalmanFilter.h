@@ -16,6 +16,10 @@ public:
 
     void update(BLA::Matrix<yN, 1> y);
 
+    // Update from another sensor on the same state, with its own sensor and covariance matrices
+    template<int zN>
+    void update(BLA::Matrix<zN, 1> y, BLA::Matrix<zN, xN> C_z, BLA::Matrix<zN, zN> R_z);
+
 
     BLA::Matrix<xN, 1> x;   // State estimate
     BLA::Matrix<xN, xN> P;  // State estimate covariance matrix
@@ -37,11 +41,17 @@ void KalmanFilter<xN, yN, uN>::predict(BLA::Matrix<uN, 1> u) {
 
 template<int xN, int yN, int uN>
 void KalmanFilter<xN, yN, uN>::update(BLA::Matrix<yN, 1> y) {
-    auto residual = y - C * x;
-    auto S = C * P * (~C) + R;
-    auto K = P * (~C) * (S.Inverse());
+    update<yN>(y, C, R);
+}
+
+template<int xN, int yN, int uN>
+template<int zN>
+void KalmanFilter<xN, yN, uN>::update(BLA::Matrix<zN, 1> y, BLA::Matrix<zN, xN> C_z, BLA::Matrix<zN, zN> R_z) {
+    auto residual = y - C_z * x;
+    auto S = C_z * P * (~C_z) + R_z;
+    auto K = P * (~C_z) * (S.Inverse());
     x = x + K * residual;
-    P = (BLA::Identity<xN, xN>() - K * C) * P;
+    P = (BLA::Identity<xN, xN>() - K * C_z) * P;
 }
 
 
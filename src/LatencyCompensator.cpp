@@ -0,0 +1,116 @@
+//
+// Delay prediction by replaying in-flight torques, and actuation delay measurement from torque steps
+//
+
+#include "LatencyCompensator.h"
+#include <Arduino.h>
+
+#define LATENCY_STEP_MIN    0.5f    // Smallest commanded torque step (Nm) used to measure delay
+#define LATENCY_GAIN        0.2f    // Weight of each new delay measurement in the running estimate
+
+LatencyCompensator::LatencyCompensator(BikeModel *model, float actuation_delay) {
+    this->model = model;
+    this->actuation_delay = actuation_delay;
+    this->sensor_delay = 0;
+}
+
+void LatencyCompensator::setActuationDelay(float delay) {
+    actuation_delay = constrain(delay, 0.0f, LATENCY_MAX);
+}
+
+void LatencyCompensator::setSensorDelay(float delay) {
+    sensor_delay = constrain(delay, 0.0f, LATENCY_MAX);
+}
+
+float LatencyCompensator::getActuationDelay() const {
+    return actuation_delay;
+}
+
+float LatencyCompensator::getDelay() const {
+    return actuation_delay + sensor_delay;
+}
+
+void LatencyCompensator::setAutoMeasure(bool enabled) {
+    auto_measure = enabled;
+    measuring = false;
+}
+
+void LatencyCompensator::reset() {
+    head = 0;
+    count = 0;
+    measuring = false;
+    last_commanded = 0;
+}
+
+void LatencyCompensator::record(float torque, float dt) {
+    torques[head] = torque;
+    durations[head] = dt;
+    head = (head + 1) % LATENCY_BUFFER_LEN;
+    if (count < LATENCY_BUFFER_LEN)
+        count++;
+}
+
+void LatencyCompensator::measure(float commanded, float actual, float dt) {
+    if (!auto_measure)
+        return;
+
+    if (measuring) {
+        // Delay is the time for the measured torque to cover half of the commanded step
+        step_elapsed += dt;
+        if ((actual - step_from) / (step_to - step_from) >= 0.5f) {
+            setActuationDelay(actuation_delay + LATENCY_GAIN * (step_elapsed - actuation_delay));
+            measuring = false;
+        } else if (step_elapsed > LATENCY_MAX) {
+            measuring = false;
+        }
+    } else if (fabs(commanded - last_commanded) > LATENCY_STEP_MIN && fabs(commanded - actual) > LATENCY_STEP_MIN) {
+        // The step must also be away from the measured torque, or the progress ratio divides by almost nothing
+        measuring = true;
+        step_from = actual;
+        step_to = commanded;
+        step_elapsed = 0;
+    }
+
+    last_commanded = commanded;
+}
+
+BLA::Matrix<4, 1> LatencyCompensator::predict(float phi, float del, float dphi, float ddel, float v,
+                                              bool free_running) {
+    BLA::Matrix<4, 1> x = {phi, del, dphi, ddel};
+    float horizon = getDelay();
+    if (horizon <= 0)
+        return x;
+
+    // Find the oldest recorded command still acting within the horizon
+    int n = 0;
+    float covered = 0;
+    while (n < count && covered < horizon) {
+        covered += durations[(head - 1 - n + LATENCY_BUFFER_LEN) % LATENCY_BUFFER_LEN];
+        n++;
+    }
+
+    // Commands older than the history are assumed equal to the oldest one recorded
+    float remaining = horizon;
+    if (covered < horizon) {
+        float u = n > 0 ? torques[(head - n + LATENCY_BUFFER_LEN) % LATENCY_BUFFER_LEN] : 0;
+        float h = horizon - covered;
+        BLA::Matrix<4, 1> next = model->kalmanTransitionMatrix(v, h, free_running) * x +
+                                 model->kalmanControlsMatrix(v, h, free_running) * BLA::Matrix<2, 1>{0, u};
+        x = next;
+        remaining -= h;
+    }
+
+    // Replay the buffered torques oldest first, trimming the oldest to the part inside the horizon
+    float skip = covered > horizon ? covered - horizon : 0;
+    for (int i = n - 1; i >= 0 && remaining > 0; i--) {
+        int k = (head - 1 - i + LATENCY_BUFFER_LEN) % LATENCY_BUFFER_LEN;
+        float h = min(durations[k] - skip, remaining);
+        skip = 0;
+        BLA::Matrix<4, 1> next = model->kalmanTransitionMatrix(v, h, free_running) * x +
+                                 model->kalmanControlsMatrix(v, h, free_running) * BLA::Matrix<2, 1>{0, torques[k]};
+        x = next;
+        remaining -= h;
+    }
+
+    return x;
+}
@@ -0,0 +1,56 @@
+//
+// Forward prediction of the bike state across actuator and sensor delays
+//
+
+#ifndef AUTOCYCLE_STABILITY_FIRMWARE_LATENCYCOMPENSATOR_H
+#define AUTOCYCLE_STABILITY_FIRMWARE_LATENCYCOMPENSATOR_H
+
+#include <BasicLinearAlgebra.h>
+#include "BikeModel.h"
+
+#define LATENCY_BUFFER_LEN  32          // Recently commanded torques retained for prediction
+#define LATENCY_MAX         0.1f        // Longest delay that can be compensated or measured (s)
+
+class LatencyCompensator {
+public:
+    LatencyCompensator(BikeModel *model, float actuation_delay);
+
+    // Delays in seconds; prediction spans their sum
+    void setActuationDelay(float delay);
+    void setSensorDelay(float delay);
+    float getActuationDelay() const;
+    float getDelay() const;
+
+    // Enable online measurement of the actuation delay from torque steps. Off by default: the estimate sets the
+    // prediction horizon, so it should only run while the commanded torque makes clean steps.
+    void setAutoMeasure(bool enabled);
+
+    // Clear the torque history, e.g. when the actuator leaves torque mode
+    void reset();
+
+    // Record a steering torque (Nm) sent to the actuator, held for dt seconds until the next command
+    void record(float torque, float dt);
+
+    // Estimate the actuation delay from the commanded and measured actuator torque, called once per loop
+    void measure(float commanded, float actual, float dt);
+
+    // Predict {phi, del, dphi, ddel} forward by the total delay, replaying the torques still in flight
+    BLA::Matrix<4, 1> predict(float phi, float del, float dphi, float ddel, float v, bool free_running);
+
+private:
+    BikeModel *model;
+    float actuation_delay, sensor_delay;
+
+    float torques[LATENCY_BUFFER_LEN]{};
+    float durations[LATENCY_BUFFER_LEN]{};
+    int head = 0;
+    int count = 0;
+
+    bool auto_measure = false;
+    bool measuring = false;
+    float last_commanded = 0;
+    float step_from = 0, step_to = 0, step_elapsed = 0;
+};
+
+
+#endif //AUTOCYCLE_STABILITY_FIRMWARE_LATENCYCOMPENSATOR_H
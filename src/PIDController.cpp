@@ -19,3 +19,9 @@ float PIDController::control(float phi, float del, float dphi, float ddel, float
 
     return constrain(k_p * e + k_i * ei + k_d * de, -torque_max, torque_max);
 }
+
+void PIDController::transfer(float u0, float phi, float del, float dphi, float ddel, float phi_r, float del_r, float v) {
+    // Preload the integrator so that the proportional and derivative terms plus it reproduce u0
+    if (k_i != 0)
+        ei = (u0 - k_p * (phi - phi_r) - k_d * dphi) / k_i;
+}
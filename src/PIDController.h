@@ -13,6 +13,8 @@ public:
 
     float control(float phi, float del, float dphi, float ddel, float phi_r, float del_r, float v, float dt) override;
 
+    void transfer(float u0, float phi, float del, float dphi, float ddel, float phi_r, float del_r, float v) override;
+
 private:
     float ei = 0;
     float k_p, k_i, k_d;
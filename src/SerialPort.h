@@ -0,0 +1,34 @@
+//
+// Byte stream interface for device links, so drivers can run over an Arduino UART or a host pseudo-terminal
+//
+
+#ifndef AUTOCYCLE_STABILITY_FIRMWARE_SERIALPORT_H
+#define AUTOCYCLE_STABILITY_FIRMWARE_SERIALPORT_H
+
+#include <Arduino.h>
+
+class SerialPort {
+public:
+    // Bytes ready to read, the next byte or -1 if there is none, and a non-blocking write of one byte
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual size_t write(uint8_t b) = 0;
+};
+
+// Port over an Arduino Stream such as Serial1
+class StreamPort : public SerialPort {
+public:
+    explicit StreamPort(Stream *stream) : stream(stream) {}
+
+    int available() override { return stream->available(); }
+
+    int read() override { return stream->read(); }
+
+    size_t write(uint8_t b) override { return stream->write(b); }
+
+private:
+    Stream *stream;
+};
+
+
+#endif //AUTOCYCLE_STABILITY_FIRMWARE_SERIALPORT_H
@@ -0,0 +1,44 @@
+//
+// Extends the 32-bit DWT cycle counter to 64 bits by counting its wraps on every read
+//
+
+#include "Timebase.h"
+#include <Arduino.h>
+
+static uint32_t wraps = 0;
+static uint32_t last_count = 0;
+
+void timebase_begin() {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;    // Enable the trace and debug blocks, including DWT
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    wraps = 0;
+    last_count = 0;
+}
+
+uint64_t timebase_cycles() {
+    // Read and extend in one step, so an interrupt reading in between cannot count a wrap twice
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint32_t count = DWT->CYCCNT;
+    if (count < last_count)
+        wraps++;
+    last_count = count;
+    uint64_t cycles = (uint64_t) wraps << 32U | count;
+    __set_PRIMASK(primask);
+
+    return cycles;
+}
+
+uint64_t timebase_micros() {
+    return timebase_cycles() / TIMEBASE_CYCLES_PER_US;
+}
+
+float timebase_elapsed(uint64_t &last_us) {
+    uint64_t now = timebase_micros();
+    float elapsed = (float) (now - last_us) * 1e-6f;
+    last_us = now;
+
+    return elapsed;
+}
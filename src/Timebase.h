@@ -0,0 +1,24 @@
+//
+// Monotonic 64-bit time from the DWT cycle counter, shared by the loop and sensor stamps
+//
+
+#ifndef AUTOCYCLE_STABILITY_FIRMWARE_TIMEBASE_H
+#define AUTOCYCLE_STABILITY_FIRMWARE_TIMEBASE_H
+
+#include <Arduino.h>
+
+#define TIMEBASE_CYCLES_PER_US  (F_CPU / 1000000UL)
+
+// Start the cycle counter. It wraps every 2^32 cycles (51 s at 84 MHz), so time must be read at least that often
+// for the extension to count every wrap.
+void timebase_begin();
+
+// Time since timebase_begin(), in CPU cycles and in microseconds. Safe to call from interrupts.
+uint64_t timebase_cycles();
+uint64_t timebase_micros();
+
+// Seconds elapsed since last_us, moving last_us up to now
+float timebase_elapsed(uint64_t &last_us);
+
+
+#endif //AUTOCYCLE_STABILITY_FIRMWARE_TIMEBASE_H
@@ -3,6 +3,8 @@
 //
 
 #include "TorqueMotor.h"
+#include "TorqueUnits.h"
+#include "Timebase.h"
 #include <due_can.h>
 #include <Arduino.h>
 
@@ -12,9 +14,6 @@
 #define RATED_CURRENT_MA        5330
 #define MAX_CURRENT_DUR_MS      100
 #define BLDC_MOTOR              0x0000000041U
-#define RATED_TORQUE_NM         0.5f
-#define GEARING                 33.0f
-#define EFFICIENCY              0.93f
 
 // Position control word flags
 #define CTRW_POSITION_MOVE_COMMAND  0b0000000000010000U
@@ -40,6 +39,14 @@
 #define HOMING_REFERENCE_START      0b0000000000010000U
 #define HOMING_STATUSWORD1          0b0001000000000000U
 #define HOMING_STATUSWORD2          0b0000010000000000U
+#define HOMING_ERROR                0b0010000000000000U
+#define CTRW_HOMING_HALT            0b0000000100000000U
+
+// Homing current limit fault, checked against actual torque which tracks motor current
+#define HOMING_FAULT_CURRENT_MA     2500
+#define HOMING_FAULT_TORQUE_THOU    (1000L * HOMING_FAULT_CURRENT_MA / RATED_CURRENT_MA)
+#define HOMING_FAULT_MS             200
+#define HOMING_SETTLE_MS            100     // Ignore status words that may predate the homing start
 
 #define TORQUE_RX_PDO_NUM   0
 #define TORQUE_TX_PDO_NUM   0
@@ -49,6 +56,29 @@
 #define POSITION_TX_PDO_NUM 2
 #define CONTROL_RX_PDO_NUM  3
 #define CONTROL_TX_PDO_NUM  3
+#define TELEMETRY_TX_PDO_NUM 4
+
+// Drive condition objects
+#define OD_DC_LINK_VOLTAGE      0x6079U     // DC link circuit voltage (mV)
+#define OD_DRIVE_TEMPERATURE    0x4014U     // Nanotec operating conditions, subindex 2 is PCB temperature (0.1 C)
+
+// Thermal derating
+#define THERMAL_TAU_S           30.0f   // Winding thermal time constant
+#define THERMAL_DERATE_START    0.8f    // Thermal load (fraction of continuous rated I^2) where derating begins
+#define TEMP_DERATE_START       70.0f   // Drive temperature (C) where derating begins
+#define TEMP_DERATE_END         85.0f   // Drive temperature (C) where derating reaches its floor
+#define DERATE_MIN              0.25f   // Floor on the derated torque limit, as a fraction of torque_max
+#define DERATE_WRITE_STEP       0.02f   // Change in the limit, as a fraction of torque_max, that is sent to the drive
+
+// Setpoint transmission defaults
+#define TORQUE_DEADBAND_THOU    2       // Thousandths of rated torque
+#define POSITION_DEADBAND       2       // Hundredths of a radian at the motor
+#define SETPOINT_REFRESH_MS     100     // Keep-alive period for unchanged setpoints
+
+// Friction compensation
+#define FRICTION_VEL_EPS        0.05f   // Steering rate (rad/s) above which direction of motion is trusted
+#define FRICTION_TORQUE_EPS     0.05f   // Commanded torque (Nm) below which no breakaway torque is added
+#define FRICTION_SWEEP_TIMEOUT  20000   // Maximum duration of one sweep pass (ms)
 
 TorqueMotor::TorqueMotor(CANRaw *can_line, uint16_t node_id, unsigned int current_max, unsigned int torque_max,
                          unsigned int torque_slope, float prof_accel, float qs_decel, float prof_vel) {
@@ -57,6 +87,7 @@ TorqueMotor::TorqueMotor(CANRaw *can_line, uint16_t node_id, unsigned int curren
     this->current_max = current_max;
     this->torque_max = torque_max;
     this->torque_slope = torque_slope;
+    this->torque_limit = torque_max;
 
     outgoing.value = 0;
     profile_acceleration = prof_accel * 100 * GEARING;
@@ -68,6 +99,10 @@ TorqueMotor::TorqueMotor(CANRaw *can_line, uint16_t node_id, unsigned int curren
     homing_acceleration = profile_acceleration/10;
     homing_current = 1100;   //milliamps
     homing_period = 50;     //milliseconds
+
+    torque_deadband = TORQUE_DEADBAND_THOU;
+    position_deadband = POSITION_DEADBAND;
+    setpoint_refresh = SETPOINT_REFRESH_MS;
 }
 
 void TorqueMotor::start() {
@@ -104,10 +139,11 @@ void TorqueMotor::start() {
     motor_dev->configureRxPDO(TORQUE_RX_PDO_NUM, PDO_RX_TRANS_ASYNC, 1, rx_torque);
 
     // Set up TX PDOs needed for torque mode
-    PDOMapping tx_torque[1];
+    PDOMapping tx_torque[2];
 //    tx_torque[0] = {0x6074U, 0, 16}; // Current torque demand
     tx_torque[0] = {0x6077U, 0, 16}; // Current actual torque
-    motor_dev->configureTxPDO(TORQUE_TX_PDO_NUM, PDO_TX_TRANS_ASYNC_TIME, 100, 20, 1, tx_torque);
+    tx_torque[1] = {0x6078U, 0, 16}; // Current actual current
+    motor_dev->configureTxPDO(TORQUE_TX_PDO_NUM, PDO_TX_TRANS_ASYNC_TIME, 100, 20, 2, tx_torque);
 
 
     // Set up RX PDOs needed for velocity mode
@@ -143,6 +179,12 @@ void TorqueMotor::start() {
     tx_control[0] = {0x6041U, 0, 16}; // Current control demand
     motor_dev->configureTxPDO(CONTROL_TX_PDO_NUM, PDO_TX_TRANS_ASYNC_TIME, 100, 20, 1, tx_control);
 
+    // Set up low rate TX PDO for drive conditions
+    PDOMapping tx_telemetry[2];
+    tx_telemetry[0] = {OD_DC_LINK_VOLTAGE, 0, 32};      // DC bus voltage
+    tx_telemetry[1] = {OD_DRIVE_TEMPERATURE, 2, 32};    // Drive temperature
+    motor_dev->configureTxPDO(TELEMETRY_TX_PDO_NUM, PDO_TX_TRANS_ASYNC_TIME, 1000, 200, 2, tx_telemetry);
+
     delay(1000);
 
 
@@ -201,8 +243,10 @@ void TorqueMotor::autoSetup() {
 
 void TorqueMotor::setMode(uint16_t mode) {
     while (!shutdown());
+    setpoint_valid = false;     // Force the first setpoint in the new mode to be sent
     uint32_t submode_select = 0;
 
+    torque_mode = mode == OP_PROFILE_TORQUE;
     switch (mode) {
         case OP_PROFILE_TORQUE:
             // Set operation mode to profile torque
@@ -213,7 +257,8 @@ void TorqueMotor::setMode(uint16_t mode) {
             motor_dev->writeSDO(0x3202U, 0, SDO_WRITE_4B, submode_select);
             motor_dev->readSDO(0x3202U, 0, submode_select);
 
-            motor_dev->writeSDO(0x6072U, 0, SDO_WRITE_2B, torque_max); // Max torque
+            motor_dev->writeSDO(0x6072U, 0, SDO_WRITE_2B, torque_limit); // Max torque, as derated
+            drive_torque_limit = torque_limit;
             motor_dev->writeSDO(0x6087U, 0, SDO_WRITE_4B, torque_slope); // Torque slope
             break;
 
@@ -278,7 +323,15 @@ void TorqueMotor::setMode(uint16_t mode) {
     while (!switchOn());
 }
 
-void TorqueMotor::calibrate(){
+bool TorqueMotor::calibrate(unsigned long timeout_ms) {
+    startHoming(timeout_ms);
+    while (updateHoming() == HOMING_RUNNING)
+        delay(1);
+
+    return homing_state == HOMING_DONE;
+}
+
+void TorqueMotor::startHoming(unsigned long timeout_ms) {
     //Put torque motor into mode to begin sweep
     this->setMode(OP_HOMING);
     while(!enableOperation());
@@ -288,18 +341,242 @@ void TorqueMotor::calibrate(){
     outgoing.s2 = 0;
     outgoing.s3 = 0;
     motor_dev->writePDO(CONTROL_RX_PDO_NUM, outgoing);
-    //delay, update, get status
+
+    homing_state = HOMING_RUNNING;
+    homing_progress = 0;
+    homing_start = millis();
+    homing_timeout = timeout_ms;
+    homing_overcurrent_start = 0;
+}
+
+uint8_t TorqueMotor::updateHoming() {
+    if (homing_state != HOMING_RUNNING)
+        return homing_state;
+
     update();
-    while (!((getStatus() & HOMING_STATUSWORD1) && (getStatus() & HOMING_STATUSWORD2)))
-    {
+    if (millis() - homing_start < HOMING_SETTLE_MS)
+        return homing_state;
+
+    uint16_t status = getStatus();
+
+    if (status & HOMING_STATUSWORD1)
+        homing_progress = 0.5f;
+
+    if ((status & HOMING_STATUSWORD1) && (status & HOMING_STATUSWORD2)) {
+        homing_progress = 1;
+        homing_state = HOMING_DONE;
+        return homing_state;
+    }
+
+    // Current limit fault if the mechanism is pushing against something harder than the homing current allows
+    if (abs(getTorqueRaw()) > HOMING_FAULT_TORQUE_THOU) {
+        if (homing_overcurrent_start == 0)
+            homing_overcurrent_start = millis();
+        else if (millis() - homing_overcurrent_start > HOMING_FAULT_MS)
+            status |= HOMING_ERROR;
+    } else {
+        homing_overcurrent_start = 0;
+    }
+
+    if (status & HOMING_ERROR) {
+        abortHoming();
+        homing_state = HOMING_FAULT;
+    } else if (millis() - homing_start > homing_timeout) {
+        abortHoming();
+        homing_state = HOMING_TIMEOUT;
+    }
+
+    return homing_state;
+}
+
+void TorqueMotor::abortHoming() {
+    if (homing_state != HOMING_RUNNING)
+        return;
+
+    outgoing.s0 = CTRW_HOMING_HALT | 0b0000000000001111U;
+    outgoing.s1 = 0;
+    outgoing.s2 = 0;
+    outgoing.s3 = 0;
+    motor_dev->writePDO(CONTROL_RX_PDO_NUM, outgoing);
+    while (!shutdown());
+
+    homing_state = HOMING_ABORTED;
+}
+
+uint8_t TorqueMotor::getHomingState() const {
+    return homing_state;
+}
+
+float TorqueMotor::getHomingProgress() const {
+    return homing_progress;
+}
+
+bool TorqueMotor::targetReached() {
+    return getStatus() & STAW_POSITION_REACHED;
+}
+
+// Sweep out to +range, back to -range, and return to center
+static const float friction_directions[3] = {1, -1, 1};
+static const float friction_targets[3] = {1, -1, 0};        // Fractions of the range
+
+bool TorqueMotor::identifyFriction(float range, float velocity) {
+    startFriction(range, velocity);
+    while (updateFriction() == FRICTION_RUNNING)
         delay(1);
-        update();
+
+    return friction_state == FRICTION_DONE;
+}
+
+void TorqueMotor::startFriction(float range, float velocity) {
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < FRICTION_BINS; i++) {
+            friction_sums[d][i] = 0;
+            friction_counts[d][i] = 0;
+        }
+    }
+    friction_range = range;
+    friction_velocity = velocity;
+
+    setMode(OP_PROFILE_VELOCITY);
+    while (!enableOperation());
+
+    friction_pass = 0;
+    friction_state = FRICTION_RUNNING;
+    startFrictionPass();
+}
+
+void TorqueMotor::startFrictionPass() {
+    friction_pass_start = millis();
+    setVelocity(friction_directions[friction_pass] * friction_velocity);
+}
+
+uint8_t TorqueMotor::updateFriction() {
+    if (friction_state != FRICTION_RUNNING)
+        return friction_state;
+
+    update();
+    float dir = friction_directions[friction_pass];
+    float position = getPosition();
+
+    if (dir * (position - friction_targets[friction_pass] * friction_range) >= 0) {
+        if (++friction_pass < 3) {
+            startFrictionPass();
+            return friction_state;
+        }
+        return finishFriction();
     }
 
+    if (millis() - friction_pass_start > FRICTION_SWEEP_TIMEOUT) {
+        setVelocity(0);
+        while (!shutdown());
+        friction_state = FRICTION_TIMEOUT;
+        return friction_state;
+    }
+
+    // Sample only once moving at a steady rate
+    if (dir * getVelocity() > 0.5f * friction_velocity && fabs(position) < friction_range) {
+        int bin = (int) ((position + friction_range) / (2 * friction_range) * FRICTION_BINS);
+        bin = constrain(bin, 0, FRICTION_BINS - 1);
+        friction_sums[dir > 0 ? 0 : 1][bin] += fabs(getTorque());
+        friction_counts[dir > 0 ? 0 : 1][bin]++;
+    }
+
+    return friction_state;
+}
+
+uint8_t TorqueMotor::finishFriction() {
+    setVelocity(0);
+    while (!shutdown());
+
+    // Average each bin, filling bins that were never sampled from their nearest sampled neighbour
+    FrictionTable table{};
+    table.range = friction_range;
+    for (int d = 0; d < 2; d++) {
+        float *row = d == 0 ? table.positive : table.negative;
+        for (int i = 0; i < FRICTION_BINS; i++) {
+            int nearest = -1;
+            for (int j = 0; j < FRICTION_BINS; j++)
+                if (friction_counts[d][j] > 0 && (nearest < 0 || abs(j - i) < abs(nearest - i)))
+                    nearest = j;
+            if (nearest < 0) {
+                friction_state = FRICTION_FAILED;
+                return friction_state;
+            }
+            row[i] = friction_sums[d][nearest] / (float) friction_counts[d][nearest];
+        }
+    }
+
+    setFrictionTable(table);
+    friction_state = FRICTION_DONE;
+    return friction_state;
+}
+
+void TorqueMotor::abortFriction() {
+    if (friction_state != FRICTION_RUNNING)
+        return;
+
+    setVelocity(0);
+    while (!shutdown());
+    friction_state = FRICTION_ABORTED;
+}
+
+uint8_t TorqueMotor::getFrictionState() const {
+    return friction_state;
+}
+
+void TorqueMotor::getFrictionTable(FrictionTable &table) const {
+    table = friction;
+}
+
+void TorqueMotor::setFrictionTable(const FrictionTable &table) {
+    friction = table;
+}
+
+void TorqueMotor::setFrictionCompensation(bool enabled) {
+    friction_enabled = enabled && friction.range > 0;
+}
+
+float TorqueMotor::frictionTorque(float position, float velocity, float torque) const {
+    if (friction.range <= 0)
+        return 0;
+
+    // Linearly interpolate the table between bin centers
+    float x = (position + friction.range) / (2 * friction.range) * FRICTION_BINS - 0.5f;
+    x = constrain(x, 0.0f, (float) (FRICTION_BINS - 1));
+    int i = min((int) x, FRICTION_BINS - 2);
+    float w = x - (float) i;
+    float positive = (1 - w) * friction.positive[i] + w * friction.positive[i + 1];
+    float negative = (1 - w) * friction.negative[i] + w * friction.negative[i + 1];
+
+    // Direction follows measured motion when moving, blending to the commanded direction near standstill
+    float s = constrain(velocity / FRICTION_VEL_EPS, -1.0f, 1.0f);
+    if (fabs(torque) > FRICTION_TORQUE_EPS)
+        s += (1 - fabs(s)) * (torque > 0 ? 1.0f : -1.0f);
+
+    return s >= 0 ? s * positive : s * negative;
 }
 
 void TorqueMotor::setTorque(float torque) {
-    int16_t torque_thou = -1.0f * 1000.0 * torque / GEARING / EFFICIENCY / RATED_TORQUE_NM;
+    if (friction_enabled)
+        torque += frictionTorque(getPosition(), getVelocity(), torque);
+
+    setTorqueRaw((int16_t) (TORQUE_THOU_PER_NM * torque));
+}
+
+void TorqueMotor::setVelocity(float velocity) {
+    setVelocityRaw((int32_t) (VELOCITY_UNITS_PER_RAD_S * velocity));
+}
+
+void TorqueMotor::setPosition(float phi) {
+    setPositionRaw((int32_t) (POSITION_UNITS_PER_RAD * (phi - position_offset)));
+}
+
+void TorqueMotor::setTorqueRaw(int16_t torque_thou) {
+    torque_thou = constrain(torque_thou, -torque_limit, torque_limit);
+    if (!setpointStale(torque_thou - last_torque_thou, torque_deadband))
+        return;
+    last_torque_thou = torque_thou;
+
     outgoing.s0 = torque_thou;
     outgoing.s1 = 0;
     outgoing.s2 = 0;
@@ -307,16 +584,18 @@ void TorqueMotor::setTorque(float torque) {
     motor_dev->writePDO(TORQUE_RX_PDO_NUM, outgoing);
 }
 
-void TorqueMotor::setVelocity(float velocity) {
-    int32_t desired_velocity = -1.0f * 100 * velocity * GEARING;
-    outgoing.low = desired_velocity;
+void TorqueMotor::setVelocityRaw(int32_t velocity) {
+    outgoing.low = velocity;
     outgoing.high = 0;
     motor_dev->writePDO(VELOCITY_RX_PDO_NUM, outgoing);
 }
 
-void TorqueMotor::setPosition(float phi) {
-    int32_t desired_position = -1.0f * 100 * (phi - position_offset) * GEARING;
-    outgoing.low = desired_position;
+void TorqueMotor::setPositionRaw(int32_t position) {
+    if (!setpointStale(position - last_position, position_deadband))
+        return;
+    last_position = position;
+
+    outgoing.low = position;
     outgoing.high = 0;
     motor_dev->writePDO(POSITION_RX_PDO_NUM, outgoing);
 
@@ -327,23 +606,59 @@ void TorqueMotor::setPosition(float phi) {
     motor_dev->writePDO(CONTROL_RX_PDO_NUM, outgoing);
 }
 
+void TorqueMotor::setCommandDeadband(unsigned int torque_deadband, unsigned int position_deadband,
+                                     unsigned long refresh_ms) {
+    this->torque_deadband = torque_deadband;
+    this->position_deadband = position_deadband;
+    this->setpoint_refresh = refresh_ms;
+}
+
+bool TorqueMotor::setpointStale(int32_t delta, unsigned int deadband) {
+    // Transmit if nothing valid has been sent in this mode, the change exceeds the deadband, or keep-alive is due
+    if (setpoint_valid && (unsigned int) abs(delta) <= deadband && millis() - last_setpoint_time < setpoint_refresh)
+        return false;
+
+    setpoint_valid = true;
+    last_setpoint_time = millis();
+    return true;
+}
+
 float TorqueMotor::getTorque() {
+    return NM_PER_TORQUE_THOU * (float) getTorqueRaw();
+}
+
+float TorqueMotor::getVelocity() {
+    return RAD_S_PER_VELOCITY_UNIT * (float) getVelocityRaw();
+}
+
+float TorqueMotor::getPosition() {
+    return RAD_PER_POSITION_UNIT * (float) getPositionRaw() + position_offset;
+}
+
+int16_t TorqueMotor::getTorqueRaw() {
     motor_dev->readPDO(TORQUE_TX_PDO_NUM, incoming);
-    int16_t torque_thou = incoming.s0;
 
-    return -1.0f * (1 / 1000.0f) * GEARING * EFFICIENCY * RATED_TORQUE_NM * (float) torque_thou;
+    return (int16_t) incoming.s0;
 }
 
-float TorqueMotor::getVelocity() {
+int32_t TorqueMotor::getVelocityRaw() {
     motor_dev->readPDO(VELOCITY_TX_PDO_NUM, incoming);
 
-    return -1.0f * ((int32_t) incoming.low) / 100.0f / GEARING;
+    return (int32_t) incoming.low;
 }
 
-float TorqueMotor::getPosition() {
+uint64_t TorqueMotor::getPositionTime() const {
+    return motor_dev->pdoTime(POSITION_TX_PDO_NUM);
+}
+
+uint64_t TorqueMotor::getVelocityTime() const {
+    return motor_dev->pdoTime(VELOCITY_TX_PDO_NUM);
+}
+
+int32_t TorqueMotor::getPositionRaw() {
     motor_dev->readPDO(POSITION_TX_PDO_NUM, incoming);
 
-    return -1.0f * ((int32_t) incoming.low) / 100.0f / GEARING + position_offset;
+    return (int32_t) incoming.low;
 }
 
 uint16_t TorqueMotor::getStatus() {
@@ -366,10 +681,66 @@ uint16_t TorqueMotor::getStatus() {
 
 void TorqueMotor::update() {
     motor_dev->update();
+    updateThermalModel();
+}
+
+void TorqueMotor::updateThermalModel() {
+    float dt = timebase_elapsed(last_thermal_time);
+
+    // First order I^2t model, settles at the squared fraction of rated current, 1 being the continuous rating
+    float current_rel = (float) getCurrentRaw() / 1000.0f;
+    thermal_load += (current_rel * current_rel - thermal_load) * min(dt / THERMAL_TAU_S, 1.0f);
+
+    float i2t_scale = 1 - (thermal_load - THERMAL_DERATE_START) / (1 - THERMAL_DERATE_START) * (1 - DERATE_MIN);
+    float temp_scale = 1 - (getDriveTemperature() - TEMP_DERATE_START) / (TEMP_DERATE_END - TEMP_DERATE_START)
+                           * (1 - DERATE_MIN);
+    float scale = constrain(min(i2t_scale, temp_scale), DERATE_MIN, 1.0f);
+
+    torque_limit = (int16_t) (scale * (float) torque_max);
+
+    // The drive enforces its own copy, kept within a step of the derated limit so it is rewritten only now and then,
+    // and put back exactly once derating ends
+    bool step = (float) abs(torque_limit - drive_torque_limit) >= DERATE_WRITE_STEP * (float) torque_max;
+    bool restored = torque_limit == (int16_t) torque_max && drive_torque_limit != torque_limit;
+    if (torque_mode && (step || restored)) {
+        motor_dev->writeSDO(0x6072U, 0, SDO_WRITE_2B, torque_limit);
+        drive_torque_limit = torque_limit;
+    }
+}
+
+int16_t TorqueMotor::getCurrentRaw() {
+    motor_dev->readPDO(TORQUE_TX_PDO_NUM, incoming);
+
+    return (int16_t) incoming.s1;
+}
+
+float TorqueMotor::getCurrent() {
+    return fabs((float) getCurrentRaw()) * (RATED_CURRENT_MA / 1000000.0f);
+}
+
+float TorqueMotor::getBusVoltage() {
+    motor_dev->readPDO(TELEMETRY_TX_PDO_NUM, incoming);
+
+    return (float) incoming.low / 1000.0f;
+}
+
+float TorqueMotor::getDriveTemperature() {
+    motor_dev->readPDO(TELEMETRY_TX_PDO_NUM, incoming);
+
+    return (float) (int32_t) incoming.high / 10.0f;
+}
+
+float TorqueMotor::getThermalLoad() const {
+    return thermal_load;
+}
+
+float TorqueMotor::getTorqueLimit() const {
+    return fabs(NM_PER_TORQUE_THOU * (float) torque_limit);
 }
 
 bool TorqueMotor::shutdown() {
     uint32_t status = 0;
+    setpoint_valid = false;
 
     // Shutdown
     motor_dev->writeSDO(0x6040U, 0, SDO_WRITE_2B, 0b00000110);
@@ -16,6 +16,31 @@
 #define OP_PROFILE_POSITION     0x01U
 #define OP_HOMING               0x06U
 
+// Homing states
+#define HOMING_IDLE             0
+#define HOMING_RUNNING          1
+#define HOMING_DONE             2
+#define HOMING_TIMEOUT          3
+#define HOMING_FAULT            4
+#define HOMING_ABORTED          5
+
+// Friction sweep states
+#define FRICTION_IDLE           0
+#define FRICTION_RUNNING        1
+#define FRICTION_DONE           2
+#define FRICTION_TIMEOUT        3
+#define FRICTION_FAILED         4       // Some direction had no bin sampled at a steady rate
+#define FRICTION_ABORTED        5
+
+// Friction and cogging compensation table
+#define FRICTION_BINS           16
+
+typedef struct {
+    float range;                        // Table spans steering positions -range to range (rad)
+    float positive[FRICTION_BINS];      // Friction torque opposing positive steering motion (Nm)
+    float negative[FRICTION_BINS];      // Friction torque opposing negative steering motion (Nm)
+} FrictionTable;
+
 class TorqueMotor {
 public:
     TorqueMotor(CANRaw *can_line, uint16_t node_id, unsigned int current_max, unsigned int torque_max,
@@ -27,7 +52,37 @@ public:
 
     void setMode(uint16_t mode);
 
-    void calibrate();
+    // Blocking homing, returns true if the reference was found before the timeout
+    bool calibrate(unsigned long timeout_ms = 10000);
+
+    // Non-blocking homing: start, then poll updateHoming() each loop until it no longer returns HOMING_RUNNING
+    void startHoming(unsigned long timeout_ms);
+    uint8_t updateHoming();
+    void abortHoming();
+    uint8_t getHomingState() const;
+    float getHomingProgress() const;    // 0 at start, 0.5 once the reference is found, 1 when complete
+
+    // True once the drive reports the current position or velocity target reached
+    bool targetReached();
+
+    // Sweeps the steering slowly across +/- range (rad) at velocity (rad/s) in velocity mode and records the torque
+    // needed to keep moving in each position bin, then shuts the drive down. Steering must be free to move and
+    // referenced. Blocking, returns true if a table was identified.
+    bool identifyFriction(float range, float velocity);
+
+    // Non-blocking sweep: start, then poll updateFriction() each loop until it no longer returns FRICTION_RUNNING.
+    // On FRICTION_DONE the new table is in place.
+    void startFriction(float range, float velocity);
+    uint8_t updateFriction();
+    void abortFriction();
+    uint8_t getFrictionState() const;
+
+    void getFrictionTable(FrictionTable &table) const;
+    void setFrictionTable(const FrictionTable &table);
+    void setFrictionCompensation(bool enabled);
+
+    // Feedforward torque in Nm cancelling friction and cogging at the given position, velocity and commanded torque
+    float frictionTorque(float position, float velocity, float torque) const;
 
     // Torque in Nm
     void setTorque(float torque);
@@ -38,6 +93,10 @@ public:
     // position in rad
     void setPosition(float phi);
 
+    // Setpoints are only transmitted when they move by more than the deadband (torque in thousandths of rated
+    // torque, position in hundredths of a motor radian) or when refresh_ms has passed since the last transmission
+    void setCommandDeadband(unsigned int torque_deadband, unsigned int position_deadband, unsigned long refresh_ms);
+
     // Torque in Nm
     float getTorque();
 
@@ -47,8 +106,32 @@ public:
     // position in rad
     float getPosition();
 
+    // Raw drive units: torque in thousandths of rated motor torque, velocity in hundredths of a motor radian per
+    // second, position in hundredths of a motor radian, all in the drive's sign convention
+    void setTorqueRaw(int16_t torque_thou);
+    void setVelocityRaw(int32_t velocity);
+    void setPositionRaw(int32_t position);
+
+    int16_t getTorqueRaw();
+    int32_t getVelocityRaw();
+    int32_t getPositionRaw();
+
     uint16_t getStatus();
 
+    // Timebase time (us) the position and velocity readings were received
+    uint64_t getPositionTime() const;
+    uint64_t getVelocityTime() const;
+
+    // Drive conditions: motor current in A, DC bus voltage in V, drive temperature in C
+    int16_t getCurrentRaw();
+    float getCurrent();
+    float getBusVoltage();
+    float getDriveTemperature();
+
+    // Thermal model state, 1 being continuous operation at rated current, and the resulting derated torque limit in Nm
+    float getThermalLoad() const;
+    float getTorqueLimit() const;
+
 //    // Speed in rad/s
 //    float getTargetVelocity();
 //
@@ -82,6 +165,42 @@ private:
     uint32_t profile_acceleration, quick_stop_deceleration, profile_velocity;
     uint32_t homing_offset,homing_method,homing_velocity,homing_acceleration,homing_current,homing_period;
     BytesUnion outgoing{}, incoming{};
+
+    // Last transmitted setpoints, used to suppress redundant PDOs
+    int16_t last_torque_thou = 0;
+    int32_t last_position = 0;
+    bool setpoint_valid = false;
+    unsigned long last_setpoint_time = 0;
+    unsigned int torque_deadband, position_deadband;
+    unsigned long setpoint_refresh;
+
+    bool setpointStale(int32_t delta, unsigned int deadband);
+
+    uint8_t homing_state = HOMING_IDLE;
+    float homing_progress = 0;
+    unsigned long homing_start = 0, homing_timeout = 0, homing_overcurrent_start = 0;
+
+    // Thermal derating of torque_max
+    float thermal_load = 0;
+    int16_t torque_limit;
+    int16_t drive_torque_limit = 0;     // Last limit written to the drive's max torque object
+    bool torque_mode = false;
+    uint64_t last_thermal_time = 0;
+
+    void updateThermalModel();
+
+    FrictionTable friction{};
+    bool friction_enabled = false;
+
+    uint8_t friction_state = FRICTION_IDLE;
+    int friction_pass = 0;
+    float friction_range = 0, friction_velocity = 0;
+    unsigned long friction_pass_start = 0;
+    float friction_sums[2][FRICTION_BINS]{};
+    int friction_counts[2][FRICTION_BINS]{};
+
+    void startFrictionPass();
+    uint8_t finishFriction();
 };
 
 
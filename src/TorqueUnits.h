@@ -0,0 +1,24 @@
+//
+// Steering drive gearing and the unit conversions between steering-side SI units and drive units. Kept free of
+// Arduino dependencies so host tools can use the same constants.
+//
+
+#ifndef AUTOCYCLE_STABILITY_FIRMWARE_TORQUEUNITS_H
+#define AUTOCYCLE_STABILITY_FIRMWARE_TORQUEUNITS_H
+
+#define RATED_TORQUE_NM         0.5f
+#define GEARING                 33.0f
+#define EFFICIENCY              0.93f
+
+// Folded to single-precision constants at compile time. Drive torque is in thousandths of rated torque, position in
+// hundredths of a motor radian, and velocity in hundredths of a motor radian per second. The drive's positive
+// direction is opposite the steering convention.
+#define TORQUE_THOU_PER_NM          (-1000.0f / (GEARING * EFFICIENCY * RATED_TORQUE_NM))
+#define NM_PER_TORQUE_THOU          (-(GEARING * EFFICIENCY * RATED_TORQUE_NM) / 1000.0f)
+#define POSITION_UNITS_PER_RAD      (-100.0f * GEARING)
+#define RAD_PER_POSITION_UNIT       (-1.0f / (100.0f * GEARING))
+#define VELOCITY_UNITS_PER_RAD_S    (-100.0f * GEARING)
+#define RAD_S_PER_VELOCITY_UNIT     (-1.0f / (100.0f * GEARING))
+
+
+#endif //AUTOCYCLE_STABILITY_FIRMWARE_TORQUEUNITS_H
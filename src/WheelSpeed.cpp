@@ -0,0 +1,143 @@
+//
+// The channel runs free from MCK/2 and latches its count into RA on every rising edge of TIOA0, so the edge time is
+// exact to two CPU cycles no matter how late the interrupt runs. The handler dates the capture on the timebase by
+// subtracting the counts elapsed since the latch.
+//
+
+#include "WheelSpeed.h"
+#include "Timebase.h"
+#include <Arduino.h>
+
+#define WHEEL_TC            TC0
+#define WHEEL_TC_CHANNEL    0
+#define WHEEL_TC_IRQn       TC0_IRQn
+#define WHEEL_TC_PMC        ID_TC0
+#define WHEEL_CYCLES_PER_COUNT  2   // TIMER_CLOCK1 is MCK/2
+
+static float distance = 0;
+
+// Written by the handler
+static volatile uint64_t last_edge = 0;     // Timebase cycles of the last accepted edge
+static volatile uint64_t last_period = 0;   // Cycles between the last two accepted edges, 0 after a stop
+static volatile uint64_t period_sum = 0;    // Running total of completed periods in cycles
+static volatile uint32_t period_count = 0;
+static volatile uint32_t edges = 0;
+static volatile uint32_t glitches = 0;
+
+// Read by the loop
+static uint64_t taken_sum = 0;
+static uint32_t taken_count = 0;
+static uint64_t last_report = 0;            // Timebase cycles of the last speed bound reported
+
+static const uint64_t min_period_cycles = (uint64_t) WHEEL_SPEED_MIN_PERIOD_US * TIMEBASE_CYCLES_PER_US;
+static const uint64_t timeout_cycles = (uint64_t) WHEEL_SPEED_TIMEOUT_MS * 1000 * TIMEBASE_CYCLES_PER_US;
+
+void TC0_Handler() {
+    uint32_t status = TC_GetStatus(WHEEL_TC, WHEEL_TC_CHANNEL);
+    if (!(status & TC_SR_LDRAS))
+        return;
+
+    TcChannel &channel = WHEEL_TC->TC_CHANNEL[WHEEL_TC_CHANNEL];
+    uint32_t captured = channel.TC_RA;
+    uint32_t now = channel.TC_CV;
+    uint64_t edge = timebase_cycles() - (uint64_t) (now - captured) * WHEEL_CYCLES_PER_COUNT;
+
+    uint64_t period = edge - last_edge;
+    if (edges > 0 && period < min_period_cycles) {
+        glitches++;
+        return;
+    }
+
+    // The first edge after a stop only starts the next period
+    if (edges > 0 && period < timeout_cycles) {
+        last_period = period;
+        period_sum += period;
+        period_count++;
+    } else {
+        last_period = 0;
+    }
+
+    last_edge = edge;
+    edges++;
+}
+
+void wheel_speed_begin(float distance_per_pulse) {
+    distance = distance_per_pulse;
+
+    NVIC_DisableIRQ(WHEEL_TC_IRQn);
+    NVIC_ClearPendingIRQ(WHEEL_TC_IRQn);
+
+    pmc_set_writeprotect(false);
+    pmc_enable_periph_clk(WHEEL_TC_PMC);
+
+    // Hand the pin to the timer
+    PIO_Configure(PIOB, PIO_PERIPH_B, PIO_PB25B_TIOA0, PIO_DEFAULT);
+
+    // Capture mode, free running, load RA on rising TIOA
+    TC_Configure(WHEEL_TC, WHEEL_TC_CHANNEL, TC_CMR_TCCLKS_TIMER_CLOCK1 | TC_CMR_LDRA_RISING);
+    TC_Start(WHEEL_TC, WHEEL_TC_CHANNEL);
+
+    WHEEL_TC->TC_CHANNEL[WHEEL_TC_CHANNEL].TC_IER = TC_IER_LDRAS;
+    WHEEL_TC->TC_CHANNEL[WHEEL_TC_CHANNEL].TC_IDR = ~TC_IER_LDRAS;
+
+    NVIC_SetPriority(WHEEL_TC_IRQn, 1);
+    NVIC_EnableIRQ(WHEEL_TC_IRQn);
+}
+
+bool wheel_speed_take(float &speed, uint64_t &stamp) {
+    noInterrupts();
+    uint64_t edge = last_edge;
+    uint64_t period = last_period;
+    uint64_t sum = period_sum;
+    uint32_t count = period_count;
+    interrupts();
+
+    if (count != taken_count) {
+        uint64_t span = sum - taken_sum;
+        speed = distance * (float) (count - taken_count) * (float) F_CPU / (float) span;
+        stamp = (edge - span / 2) / TIMEBASE_CYCLES_PER_US;
+
+        taken_sum = sum;
+        taken_count = count;
+        last_report = edge;
+        return true;
+    }
+
+    // A bound is only news once the next edge is overdue, and only until the zero at the timeout has gone out
+    uint64_t now = timebase_cycles();
+    if (period == 0 || now - edge <= period || last_report - edge >= timeout_cycles)
+        return false;
+    if (now - last_report < (uint64_t) WHEEL_SPEED_DECAY_MS * 1000 * TIMEBASE_CYCLES_PER_US)
+        return false;
+
+    speed = wheel_speed();
+    stamp = now / TIMEBASE_CYCLES_PER_US;
+    last_report = now;
+    return true;
+}
+
+float wheel_speed() {
+    noInterrupts();
+    uint64_t edge = last_edge;
+    uint64_t period = last_period;
+    interrupts();
+
+    // Speed is unknown until two edges have come close enough together
+    uint64_t elapsed = timebase_cycles() - edge;
+    if (period == 0 || elapsed >= timeout_cycles)
+        return 0;
+
+    // An edge that has not come yet means the wheel is turning slower than the last period showed
+    if (elapsed > period)
+        period = elapsed;
+
+    return distance * (float) F_CPU / (float) period;
+}
+
+uint32_t wheel_speed_edges() {
+    return edges;
+}
+
+uint32_t wheel_speed_glitches() {
+    return glitches;
+}
@@ -0,0 +1,32 @@
+//
+// Wheel speed from hall sensor edges timed by TC0 channel 0 input capture on TIOA0 (Due pin 2)
+//
+
+#ifndef AUTOCYCLE_STABILITY_FIRMWARE_WHEELSPEED_H
+#define AUTOCYCLE_STABILITY_FIRMWARE_WHEELSPEED_H
+
+#include <Arduino.h>
+
+#define WHEEL_SPEED_PIN             2       // TIOA0, the only capture input of TC0 channel 0
+#define WHEEL_SPEED_MIN_PERIOD_US   1000    // Edges closer than this are contact bounce or noise
+#define WHEEL_SPEED_TIMEOUT_MS      2000    // With no edge for this long the wheel is taken to be stopped
+#define WHEEL_SPEED_DECAY_MS        50      // Interval between speed bounds reported while edges are overdue
+
+// Start timing rising edges on WHEEL_SPEED_PIN, each edge marking distance_per_pulse meters of travel
+void wheel_speed_begin(float distance_per_pulse);
+
+// Speed in m/s measured since the last take, returning false if there is nothing new. A new edge gives the mean speed
+// over the periods completed since the last take, stamped with the timebase time (us) of their midpoint. While the
+// next edge is overdue the speed can be at most one pulse over the time since the last edge, and that bound is
+// reported every WHEEL_SPEED_DECAY_MS, dropping to zero after WHEEL_SPEED_TIMEOUT_MS.
+bool wheel_speed_take(float &speed, uint64_t &stamp);
+
+// Latest speed in m/s, decayed the same way while edges are overdue
+float wheel_speed();
+
+// Count of edges accepted and rejected as too close to the previous one
+uint32_t wheel_speed_edges();
+uint32_t wheel_speed_glitches();
+
+
+#endif //AUTOCYCLE_STABILITY_FIRMWARE_WHEELSPEED_H
@@ -11,6 +11,8 @@
 
 // Internal libraries
 #include "IMU.h"
+#include "IMUFusion.h"
+#include "IMUBus.h"
 #include "Indicator.h"
 #include "StateMachine.h"
 #include "StateColors.h"
@@ -22,6 +24,9 @@
 #include "FSFController.h"
 #include "KalmanFilter.h"
 #include "BikeModel.h"
+#include "LatencyCompensator.h"
+#include "Timebase.h"
+#include "WheelSpeed.h"
 
 // States
 #define IDLE    0
@@ -38,6 +43,8 @@
 #define R_STOP      0b00000100U
 #define R_RESUME    0b00001000U
 #define R_TIMEOUT   0b00010000U
+#define R_FRICTION  0b00100000U
+#define R_CAPTURE   0b01000000U
 
 // Info for torque motor
 #define TM_NODE_ID          127
@@ -45,17 +52,85 @@
 #define TM_TORQUE_MAX       1000
 #define TM_TORQUE_SLOPE     10000   // Thousandths of max torque per second
 
+// Steering friction identification sweep
+#define FRICTION_SWEEP_RANGE    0.5f    // rad
+#define FRICTION_SWEEP_VEL      0.2f    // rad/s
+#define FRICTION_MAGIC          0x46524943UL    // "FRIC", marks a valid table in FRAM
+
+#define TEMP_MODEL_MAGIC        0x54454D50UL    // "TEMP", marks a valid IMU temperature model in FRAM
+#define IMU_CAL_MAGIC           0x494D5543UL    // "IMUC", marks a valid per-device IMU calibration in FRAM
+
 // State transition constants
 #define FTHRESH (PI/4.0)      // Threshold for being fallen over
 #define UTHRESH (PI/20.0)     // Threshold for being back upright
 #define HIGH_V_THRESH 2.2
 #define LOW_V_THRESH 1.8
+#define STILL_V_THRESH 0.05   // Below this in IDLE the gyro bias is tracked
+
+// Roll measurement error from the centripetal correction, as a fraction of the correction
+#define CENTRIPETAL_REL_ERR 0.2f
+
+// Bumpless transfer between ASSIST position control and AUTO torque control. Transfers happen only at the
+// HIGH_V_THRESH/LOW_V_THRESH crossings, so the blend always completes well inside the hysteresis band.
+#define TRANSFER_TIME       0.3f    // Time (s) to blend from the position loop's torque to the controller output
+#define ASSIST_SLEW_RATE    1.0f    // Maximum steering reference rate (rad/s) in ASSIST
+
+// Initial actuation delay estimate (s), refined online from torque steps in AUTO
+#define ACTUATION_DELAY 0.02f
+
+// IMU sample rate (Hz), independent of loop rate, on-chip filter bandwidth (Hz) and full scale selections
+#define IMU_SAMPLE_RATE     1000
+#define IMU_BANDWIDTH       188
+#define IMU_ACCEL_RES       2
+#define IMU_GYRO_RES        2
+
+// Raw vibration capture length, in samples of the primary IMU at its configured rate
+#define CAPTURE_SAMPLES     2048
+#define CAPTURE_TIMEOUT_MS  10000
+
+// Second MPU-6050, AD0 high, on the front of the rear frame. Read through its FIFO, the data ready path serves one.
+// Its drain is a blocking transfer in the loop, so it samples at a decimated rate.
+#define IMU_FRONT_ADDR      0x69
+#define IMU_FRONT_SAMPLE_RATE   200
+
+static_assert(IMU_SAMPLE_RATE + IMU_FRONT_SAMPLE_RATE <= IMU_BUS_MAX_RATE(IMU_BUS_CLOCK, FIFO_SAMPLE_BYTES),
+              "IMU sample rates are more than the IMU bus can read at IMU_BUS_CLOCK");
+
+// Longest run of unusable fused IMU readings before ASSIST or AUTO stops
+#define IMU_FAULT_MS        50
+
+// MPU-6050 INT pin, read samples in the background on data ready. Without it samples are buffered in the IMU FIFO.
+#define IMU_INT_PIN         22
+
+// Hall sensor pulses per wheel revolution on WHEEL_SPEED_PIN. Uncomment to fuse wheel speed with the drive's.
+//#define WHEEL_PULSES        1
 
 // Loop timing constants (frequencies in Hz)
 #define SPEED_UPDATE_FREQ   5
 #define REPORT_UPDATE_FREQ  2
 #define STORE_UPDATE_FREQ   10
 
+// Steering homing limits
+#define HOMING_TIMEOUT_MS       15000
+#define HOME_SETTLE_MS          200     // Time for the drive to accept the zero setpoint
+#define HOME_MOVE_TIMEOUT_MS    3000
+
+// Steering reference phases, run from the loop once setup is done
+#define HOME_SEEK       0       // Drive homing routine running
+#define HOME_CENTER     1       // Moving to the zero position
+#define HOME_DONE       2
+#define HOME_FAILED     3
+
+// FRAM layout
+#define FRAM_FRICTION_ADDR      128     // Magic word followed by steering friction table
+#define FRAM_IMU_ADDR           264     // Per IMU, magic word followed by its calibration
+#define FRAM_IMU_STRIDE         64
+#define FRAM_TEMP_MODEL_ADDR    456     // Per IMU, magic word followed by its temperature model
+#define FRAM_TEMP_MODEL_STRIDE  40
+#define FRAM_TELEMETRY_START    576
+#define FRAM_TELEMETRY_END      8000
+#define TELEMETRY_RECORD_LEN    53
+
 
 #define RADIOCOMM
 
@@ -75,12 +150,16 @@ uint8_t writeAddr[] = "DNODE";
 
 // Device object definitions
 IMU imu(0x68);
+IMU imu_front(IMU_FRONT_ADDR);
+IMUFusion imus;
 Indicator indicator(3, 4, 5, 11);
 TorqueMotor *torque_motor;
+StreamPort drive_port(&Serial1);
 DriveMotor *drive_motor;
 Adafruit_FRAM_SPI fram(50);
 
 BikeModel bike_model;
+LatencyCompensator latency_compensator(&bike_model, ACTUATION_DELAY);
 
 KalmanFilter<4, 4, 2> orientation_filter;
 KalmanFilter<2, 2, 1> velocity_filter;
@@ -92,7 +171,11 @@ Controller *controller;
 // State variables
 uint8_t user_req = 0;       // User request binary flags
 uint8_t state = IDLE;
+uint8_t home_phase = HOME_SEEK;
+bool homing_ok = false;     // Steering referenced and centered, latched once homing completes
+unsigned long home_center_start = 0;
 float dt;
+uint64_t loop_time = 0;     // Timebase time of this loop iteration (us)
 float phi = 0.0;            // Roll angle (rad)
 float del = 0.0;            // Steering angle (rad)
 float dphi = 0.0;           // Roll angle rate (rad/s)
@@ -116,16 +199,23 @@ float v_r = 0.0;            // Required velocity (m/s)
 
 // Control variables
 float torque = 0.0;         // Current torque (Nm)
+float transfer_u0 = 0.0;    // Actuator torque when AUTO took over (Nm)
+float transfer_elapsed = TRANSFER_TIME;
+float del_cmd = 0.0;        // Rate limited steering position command in ASSIST (rad)
 
 // Filter tuning parameters
 float var_drive_motor = 0.04;   // Variance in (m/s^2)^2
+float var_wheel_speed = 0.0004; // Hall sensor speed measurement variance, in (m/s)^2
 float var_roll_accel = 0.01;    // Variance in (rad/s^2)^2
 float var_steer_accel = 0.01;   // Variance in (rad/s^2)^2
 float var_heading = 0.01;       // Variance in (rad/s^2)^2
+float var_roll_meas = 0.00265;  // Roll measurement variance when not turning, in rad^2
 
 void report();
 
-void home_delta();
+void update_homing();
+
+void abort_homing();
 
 void find_variances(float &var_v, float &var_a, float &var_phi, float &var_del, float &var_dphi, float &var_ddel);
 
@@ -133,15 +223,40 @@ int32_t readBack(uint32_t addr, int32_t data);
 
 void storeTelemetry(int startAddress);
 
+bool identify_friction();
+
+void capture_vibration();
+
+void load_temp_models();
+
+void save_temp_models();
+
+float configure_imus(uint16_t rate_hz, uint16_t bandwidth_hz, uint8_t accel_res, uint8_t gyro_res);
+
+void reconfigure_imus(uint16_t rate_hz, uint16_t bandwidth_hz, uint8_t accel_res, uint8_t gyro_res);
+
+void load_imu_calibration();
+
+void save_imu_calibration();
+
+// Offsets, mounting and lever arm of one IMU, stored per device
+typedef struct {
+    int16_t accel_offset[3];
+    int16_t gyro_offset[3];
+    float rotation[3][3];
+    float lever_x, lever_z;
+} IMUCalibration;
+
 void retrieveTelemetry(int startAddress);
 
 int memSize = 0;
-int framAddress = 100;
+int framAddress = FRAM_TELEMETRY_START;
 bool isRecording = false;
 
 
 void setup() {
-    Wire.begin();                               // Begin I2C interface
+    timebase_begin();                           // Start the shared microsecond clock before anything is stamped
+    imu_bus_begin();                            // Begin I2C interface in fast mode
 //    SPI.begin();                                // Begin Serial Peripheral Interface (SPI)
 
     Serial.begin(115200);
@@ -188,16 +303,31 @@ void setup() {
 
     Serial.println("Initializing Drive Motor.");
     // Initialize Bafang drive motor
-    drive_motor = new DriveMotor(DAC0);
+    drive_motor = new DriveMotor(DAC0, &drive_port);
     drive_motor->start();
+#ifdef WHEEL_PULSES
+    wheel_speed_begin(WHEEL_CIRCUMFERENCE / WHEEL_PULSES);
+#endif
     Serial.println("Initialized Drive Motor.");
 
-    imu.start();                                    // Initialize IMU
-    imu.configure(2, 2, 1);  // Set accelerometer and gyro resolution, on-chip low-pass filter
+    // Initialize IMUs. The primary is always fused, so its loss shows as a failed device rather than a missing one.
+    imu.start();
+    imus.add(&imu);
+    if (imu_front.start())
+        imus.add(&imu_front);
+    float imu_delay = configure_imus(IMU_SAMPLE_RATE, IMU_BANDWIDTH, IMU_ACCEL_RES, IMU_GYRO_RES);
+#ifdef IMU_INT_PIN
+    imu.enableAsync(IMU_INT_PIN, IMU_SAMPLE_RATE);
+#else
+    imu.enableFifo(IMU_SAMPLE_RATE);
+#endif
+    if (imus.count() > 1)
+        imu_front.enableFifo(IMU_FRONT_SAMPLE_RATE);
 
     Serial.println("Initializing controller.");
     // Initialize stability controller
     controller = new FSFController(&bike_model, 8.0, -2, -3, -4, -5);
+    latency_compensator.setSensorDelay(imu_delay);
 
     Serial.println("Initialized controller.");
     // Load parameters from FRAM
@@ -207,6 +337,7 @@ void setup() {
     var_v = 0.0004;//stored_vars[0];
     var_a = 0.02;//stored_vars[1];
     var_phi = 0.00265;//stored_vars[2];
+    var_roll_meas = var_phi;
     var_del = 0.00001;//stored_vars[3];
     var_dphi = 0.00001;//stored_vars[4];
     var_ddel = 0.00001;//stored_vars[5];
@@ -222,6 +353,18 @@ void setup() {
     gz_off = stored_offsets[5];
     imu.set_accel_offsets(ax_off, ay_off, az_off);
     imu.set_gyro_offsets(gx_off, gy_off, gz_off);
+    load_imu_calibration();
+
+    load_temp_models();
+
+    uint32_t friction_magic = 0;
+    fram.read(FRAM_FRICTION_ADDR, (uint8_t *) &friction_magic, sizeof friction_magic);
+    if (friction_magic == FRICTION_MAGIC) {
+        FrictionTable friction_table;
+        fram.read(FRAM_FRICTION_ADDR + sizeof friction_magic, (uint8_t *) &friction_table, sizeof friction_table);
+        torque_motor->setFrictionTable(friction_table);
+        torque_motor->setFrictionCompensation(true);
+    }
 
 
     // Initialize velocity Kalman filter
@@ -256,40 +399,44 @@ void setup() {
             var_gyro_z
     };
 
-    if (imu.calibrateGyroBias()) {
-        indicator.beepstring((uint8_t) 0b01110111);
-    } else {
-        indicator.beepstring((uint8_t) 0b10001000);
-    }
-
-    assert_idle();
-
-
     while (readBack(memSize, memSize) == memSize) {
         memSize += 256;
         //Serial.print("Block: #"); Serial.println(memSize/256);
     }
 
-    home_delta();
-    delay(250);
     assert_idle();
 
+    // Homing is polled from the loop, so the IMUs, radio and stop requests are served while it runs
+    torque_motor->startHoming(HOMING_TIMEOUT_MS);
+
     Serial.println("Finished setup.");
+    loop_time = timebase_micros();
 }
 
 void loop() {
-    static unsigned long last_time = millis();
     static unsigned long last_speed_time = millis();
     static unsigned long last_report_time = millis();
     static unsigned long last_store_time = millis();
     static unsigned long timeout = 0;
-    dt = (float) (millis() - last_time) / 1000.0f;
-    last_time = millis();
-
-    // Update sensor information
-    imu.update();
+    static unsigned long last_imu_time = millis();
+    dt = timebase_elapsed(loop_time);
+
+    // Update sensor information, removing the centripetal acceleration of the turn from the last estimates
+    imus.setCentripetal(v * dheading);
+    imus.setBiasTracking(state == IDLE && fabs(v) < STILL_V_THRESH);
+    if (imus.update())
+        last_imu_time = millis();
+    bool imu_fault = millis() - last_imu_time > IMU_FAULT_MS;
     torque_motor->update();
 
+    // A stop request halts homing, and is consumed so it does not carry into a later run
+    bool homing = home_phase == HOME_SEEK || home_phase == HOME_CENTER;
+    if (homing && (user_req & R_STOP)) {
+        user_req &= ~R_STOP;
+        abort_homing();
+    }
+    update_homing();
+
 
     // Update heading Kalman filter parameters
     heading_filter.A = {
@@ -301,7 +448,7 @@ void loop() {
             var_heading * dt, var_heading
     };
     heading_filter.predict({0});
-    heading_filter.update({imu.gyroZ()});
+    heading_filter.update({imus.gyroZ()});
     heading = heading_filter.x(0);
     dheading = heading_filter.x(1);
 
@@ -318,23 +465,45 @@ void loop() {
 //    velocity_filter.x(1) = imu.accelX();
     velocity_filter.predict({0});
 
-    // Update velocity state measurement
+    // Update velocity state measurement. The speed query goes out at SPEED_UPDATE_FREQ and its reply is collected
+    // over the following loops.
     if (millis() - last_speed_time >= 1000 / SPEED_UPDATE_FREQ) {
-        v_y = drive_motor->getSpeed();
-//        v = v_y;
-        float a_y = imu.accelX();
+        drive_motor->requestSpeed();
         last_speed_time = millis();
+    }
+    if (drive_motor->update()) {
+        // Bring the reading forward from when the controller sampled it
+        float speed_age = (float) (timebase_micros() - drive_motor->getSpeedTime()) * 1e-6f;
+        v_y = drive_motor->getSpeed() + velocity_filter.x(1) * speed_age;
+//        v = v_y;
+        float a_y = imus.accelX();
 
         velocity_filter.update({v_y, a_y});
     }
+#ifdef WHEEL_PULSES
+    // Each wheel edge measures speed alone, over the period that ended at it
+    float v_wheel;
+    uint64_t wheel_time;
+    if (wheel_speed_take(v_wheel, wheel_time)) {
+        float wheel_age = (float) (timebase_micros() - wheel_time) * 1e-6f;
+        velocity_filter.update<1>({v_wheel + velocity_filter.x(1) * wheel_age}, {1, 0}, {var_wheel_speed});
+    }
+#endif
     v = velocity_filter.x(0);
+    drive_motor->regulate(v, dt);
 
     // Update orientation state measurement
-    float g_mag = imu.accelY() * imu.accelY() +
-                  imu.accelZ() * imu.accelZ();    // Check if measured orientation gravity vector exceeds feasibility
-    phi_y = g_mag <= 10 * 10 ? atan2(imu.accelY(), imu.accelZ()) : phi_y;
+    phi_y = imus.roll();
+
+    // Roll is less certain the larger the centripetal correction, and the more the gyro and kinematic yaw rates
+    // disagree on it. Heading is measured about the upward axis, the model's yaw rate about the downward one.
+    float a_c = v * dheading;
+    float yaw_rate_error = dheading + bike_model.yawRate(v, del);
+    float a_c_var = CENTRIPETAL_REL_ERR * CENTRIPETAL_REL_ERR * a_c * a_c + v * v * yaw_rate_error * yaw_rate_error;
+    orientation_filter.R(0, 0) = var_roll_meas + a_c_var / (GRAV * GRAV);
+
     del_y = torque_motor->getPosition();
-    dphi_y = imu.gyroX();
+    dphi_y = imus.rollRate();
     ddel_y = torque_motor->getVelocity();
     torque = torque_motor->getTorque();
 
@@ -361,17 +530,27 @@ void loop() {
     indicator.update();
 
 
+    // The friction sweep takes over the steering, so it is only started from IDLE, never queued from another state
+    if (state != IDLE && state != CALIB)
+        user_req &= ~R_FRICTION;
+
     // Act based on machine state, transition if necessary
     switch (state) {
         case IDLE:      // Idle
             // Transitions
             if (fabs(phi) > FTHRESH)
                 assert_fallen();
-            if (v > 0.6)
+            if (v > 0.6 && !imu_fault && homing_ok)
                 assert_assist();
-            if (user_req & R_CALIB)
+            // The sweep drives the steering to referenced positions, so it needs homing to have succeeded
+            if ((user_req & R_FRICTION) && !homing && !homing_ok) {
+                user_req &= ~R_FRICTION;
+                indicator.beepstring((uint8_t) 0b11001100);
+            }
+            // Held until homing ends, since leaving these states shuts the steering drive down
+            if ((user_req & (R_CALIB | R_FRICTION | R_CAPTURE)) && !homing)
                 assert_calibrate();
-            if (user_req & R_MANUAL)
+            if ((user_req & R_MANUAL) && !homing)
                 assert_manual();
 
             // Action
@@ -380,15 +559,26 @@ void loop() {
             break;
 
         case CALIB:     // Sensor calibration
+            // Action. The friction sweep runs over many loops, ended early by a stop or by a request replacing it.
+            if (user_req & R_STOP)
+                user_req &= ~(R_STOP | R_FRICTION);
+            if (!(user_req & R_FRICTION))
+                torque_motor->abortFriction();
+            if ((user_req & R_FRICTION) && identify_friction())
+                user_req &= ~R_FRICTION;
+            if (user_req & R_FRICTION)
+                break;
+            if (user_req & R_CALIB)
+                calibrate();
+            if (user_req & R_CAPTURE)
+                capture_vibration();
+
             // Transitions
             if (true) {
-                user_req &= ~R_CALIB;
+                user_req &= ~(R_CALIB | R_CAPTURE);
                 assert_idle();
             }
 
-            // Action
-            calibrate();
-
 
             break;
 
@@ -408,11 +598,11 @@ void loop() {
             // Transitions
             if (fabs(phi) > FTHRESH)
                 assert_fallen();
-            if (v > HIGH_V_THRESH)
+            if (v > HIGH_V_THRESH && homing_ok)
                 assert_automatic();
             if (v < 0.5)
                 assert_idle();
-            if (user_req & R_STOP)
+            if ((user_req & R_STOP) || imu_fault)
                 assert_emergency_stop();
 
             // Action
@@ -426,7 +616,7 @@ void loop() {
                 assert_fallen();
             if (v < LOW_V_THRESH)
                 assert_assist();
-            if (user_req & R_STOP)
+            if ((user_req & R_STOP) || imu_fault)
                 assert_emergency_stop();
 
             // Action
@@ -476,9 +666,9 @@ void loop() {
         last_report_time = millis();
     }
     if (millis() - last_store_time >= 1000 / STORE_UPDATE_FREQ) {
-        if (framAddress < (8000 - 53) && isRecording == true) {
+        if (framAddress < (FRAM_TELEMETRY_END - TELEMETRY_RECORD_LEN) && isRecording == true) {
             storeTelemetry(framAddress);
-            framAddress += 53;
+            framAddress += TELEMETRY_RECORD_LEN;
         }
         last_store_time = millis();
     }
@@ -517,6 +707,23 @@ void loop() {
             case 'q':
                 isRecording = false;
                 break;
+            case 'i':
+                reconfigure_imus(*((uint16_t *) &(buffer[2])), *((uint16_t *) &(buffer[4])), buffer[6], buffer[7]);
+                break;
+            case 'v':
+                user_req |= R_CAPTURE;
+                break;
+            case 'w':
+                imus.beginTempLearning();
+                break;
+            case 'x':
+                if (imus.finishTempLearning()) {
+                    save_temp_models();
+                    indicator.beepstring((uint8_t) 0b11100111);
+                } else {
+                    indicator.beepstring((uint8_t) 0b10011001);
+                }
+                break;
 
             default:
                 break;
@@ -541,7 +748,7 @@ void loop() {
                 user_req |= R_TIMEOUT;
                 break;
             case 'f':
-                retrieveTelemetry(100);
+                retrieveTelemetry(FRAM_TELEMETRY_START);
                 break;
             case 'r':
                 isRecording = true;
@@ -549,6 +756,33 @@ void loop() {
             case 'q':
                 isRecording = false;
                 break;
+            case 'i': {
+                // parseInt() gives 0 on a timeout, rejected as a rate or bandwidth, and longs are checked before narrowing
+                long rate = Serial.parseInt();
+                long bandwidth = Serial.parseInt();
+                long accel_res = Serial.parseInt();
+                long gyro_res = Serial.parseInt();
+                if (rate > 0 && rate <= UINT16_MAX && bandwidth > 0 && bandwidth <= UINT16_MAX &&
+                    accel_res >= 0 && accel_res <= 3 && gyro_res >= 0 && gyro_res <= 3)
+                    reconfigure_imus(rate, bandwidth, accel_res, gyro_res);
+                else
+                    indicator.beepstring((uint8_t) 0b10011001);
+                break;
+            }
+            case 'v':
+                user_req |= R_CAPTURE;
+                break;
+            case 'w':
+                imus.beginTempLearning();
+                break;
+            case 'x':
+                if (imus.finishTempLearning()) {
+                    save_temp_models();
+                    indicator.beepstring((uint8_t) 0b11100111);
+                } else {
+                    indicator.beepstring((uint8_t) 0b10011001);
+                }
+                break;
 
             default:
                 break;
@@ -558,8 +792,11 @@ void loop() {
     }
 
     if (Serial.available()) {
-        if (Serial.read() == 'f') {
-            retrieveTelemetry(100);
+        uint8_t c = Serial.read();
+        if (c == 'f') {
+            retrieveTelemetry(FRAM_TELEMETRY_START);
+        } else if (c == 'v') {
+            user_req |= R_CAPTURE;
         }
     }
 }
@@ -569,14 +806,21 @@ void idle() {
 }
 
 void calibrate() {
+    bool gyro_ok = true, accel_ok = true;
+    for (int i = 0; i < imus.count(); i++) {
+        if (imus.healthy(i)) {
+            gyro_ok &= imus.device(i)->calibrateGyroBias();
+            accel_ok &= imus.device(i)->calibrateAccelBias(0, 0, GRAV);
+        }
+    }
 
-    if (imu.calibrateGyroBias()) {
+    if (gyro_ok) {
         indicator.beepstring((uint8_t) 0b01110111);
     } else {
         indicator.beepstring((uint8_t) 0b10001000);
     }
 
-    if (imu.calibrateAccelBias(0, 0, GRAV)) {
+    if (accel_ok) {
         indicator.beepstring((uint8_t) 0b10101010);
     } else {
         indicator.beepstring((uint8_t) 0b00110011);
@@ -586,6 +830,7 @@ void calibrate() {
 
     float var_v, var_a, var_phi, var_del, var_dphi, var_ddel;
     find_variances(var_v, var_a, var_phi, var_del, var_dphi, var_ddel);
+    var_roll_meas = var_phi;
     velocity_filter.R = {
             var_v, 0,
             0, var_a
@@ -624,10 +869,193 @@ void calibrate() {
     fram.write(sizeof stored_vars, (uint8_t *) stored_offsets, sizeof stored_offsets);
     fram.writeEnable(false);
 
+    save_temp_models();         // Offsets now hold at new reference temperatures
+    save_imu_calibration();
+
 
     indicator.beepstring((uint8_t) 0b11101110);
 }
 
+bool identify_friction() {
+    // Polled each loop in CALIB, starting the sweep on the first call, true once it has finished either way
+    if (torque_motor->getFrictionState() != FRICTION_RUNNING) {
+        torque_motor->setFrictionCompensation(false);
+        torque_motor->startFriction(FRICTION_SWEEP_RANGE, FRICTION_SWEEP_VEL);
+        return false;
+    }
+
+    uint8_t friction_state = torque_motor->updateFriction();
+    if (friction_state == FRICTION_RUNNING)
+        return false;
+    if (friction_state != FRICTION_DONE) {
+        indicator.beepstring((uint8_t) 0b11001100);
+        return true;
+    }
+
+    // Save friction table to FRAM
+    FrictionTable friction_table;
+    uint32_t friction_magic = FRICTION_MAGIC;
+    torque_motor->getFrictionTable(friction_table);
+    fram.writeEnable(true);
+    fram.write(FRAM_FRICTION_ADDR, (uint8_t *) &friction_magic, sizeof friction_magic);
+    fram.writeEnable(true);
+    fram.write(FRAM_FRICTION_ADDR + sizeof friction_magic, (uint8_t *) &friction_table, sizeof friction_table);
+    fram.writeEnable(false);
+
+    torque_motor->setFrictionCompensation(true);
+    indicator.beepstring((uint8_t) 0b11110000);
+    return true;
+}
+
+IMUSample capture_buffer[CAPTURE_SAMPLES];
+uint32_t capture_time[CAPTURE_SAMPLES];     // us from the first sample
+
+void capture_vibration() {
+    // Take every sample of the primary IMU into RAM first, streaming only afterwards so Serial cannot stall the drain
+    int n = 0;
+    uint64_t start = 0;
+    unsigned long timeout = millis() + CAPTURE_TIMEOUT_MS;
+    while (n < CAPTURE_SAMPLES && millis() < timeout) {
+        if (!imu.update())
+            continue;
+        for (int i = 0; i < imu.sampleCount() && n < CAPTURE_SAMPLES; i++, n++) {
+            if (n == 0)
+                start = imu.sampleTime(i);
+            capture_buffer[n] = imu.sample(i);
+            capture_time[n] = (uint32_t) (imu.sampleTime(i) - start);
+        }
+    }
+
+    Serial.println();
+    Serial.println("CAPTURE BEGINNING");
+    Serial.print("rate\t");
+    Serial.print(imu.sampleRate());
+    Serial.print("\taccel_fsr\t");
+    Serial.print(imu.accelRange());
+    Serial.print("\tgyro_fsr\t");
+    Serial.print(imu.gyroRange());
+    Serial.print("\tsamples\t");
+    Serial.println(n);
+    for (int i = 0; i < n; i++) {
+        const IMUSample &s = capture_buffer[i];
+        Serial.print(capture_time[i]);
+        Serial.print('\t');
+        Serial.print(s.a_x);
+        Serial.print('\t');
+        Serial.print(s.a_y);
+        Serial.print('\t');
+        Serial.print(s.a_z);
+        Serial.print('\t');
+        Serial.print(s.g_x);
+        Serial.print('\t');
+        Serial.print(s.g_y);
+        Serial.print('\t');
+        Serial.println(s.g_z);
+    }
+    Serial.println("CAPTURE END");
+    Serial.flush();
+
+    indicator.beepstring((uint8_t) 0b10101111);
+}
+
+void load_temp_models() {
+    for (int i = 0; i < imus.count(); i++) {
+        uint32_t addr = FRAM_TEMP_MODEL_ADDR + i * FRAM_TEMP_MODEL_STRIDE;
+        uint32_t temp_model_magic = 0;
+        fram.read(addr, (uint8_t *) &temp_model_magic, sizeof temp_model_magic);
+        if (temp_model_magic != TEMP_MODEL_MAGIC)
+            continue;
+
+        IMUTempModel temp_model;
+        fram.read(addr + sizeof temp_model_magic, (uint8_t *) &temp_model, sizeof temp_model);
+        imus.device(i)->setTempModel(temp_model);
+        imus.device(i)->setTempCompensation(true);
+    }
+}
+
+void save_temp_models() {
+    // Only a learned or loaded model is marked valid, otherwise the next boot would compensate with zero slopes
+    for (int i = 0; i < imus.count(); i++) {
+        if (!imus.device(i)->hasTempModel())
+            continue;
+
+        uint32_t addr = FRAM_TEMP_MODEL_ADDR + i * FRAM_TEMP_MODEL_STRIDE;
+        uint32_t temp_model_magic = TEMP_MODEL_MAGIC;
+
+        IMUTempModel temp_model;
+        imus.device(i)->getTempModel(temp_model);
+        fram.writeEnable(true);
+        fram.write(addr, (uint8_t *) &temp_model_magic, sizeof temp_model_magic);
+        fram.writeEnable(true);
+        fram.write(addr + sizeof temp_model_magic, (uint8_t *) &temp_model, sizeof temp_model);
+        fram.writeEnable(false);
+    }
+}
+
+float configure_imus(uint16_t rate_hz, uint16_t bandwidth_hz, uint8_t accel_res, uint8_t gyro_res) {
+    // Every device takes the same settings, so a rejection comes from the first before any has changed. Devices
+    // past the primary are drained by blocking reads and stay decimated.
+    float delay = 0;
+    for (int i = 0; i < imus.count(); i++) {
+        uint16_t device_rate = i == 0 ? rate_hz : min(rate_hz, (uint16_t) IMU_FRONT_SAMPLE_RATE);
+        float device_delay = imus.device(i)->configure(device_rate, bandwidth_hz, accel_res, gyro_res);
+        if (device_delay < 0)
+            return device_delay;
+        delay = max(delay, device_delay);
+    }
+
+    return delay;
+}
+
+void reconfigure_imus(uint16_t rate_hz, uint16_t bandwidth_hz, uint8_t accel_res, uint8_t gyro_res) {
+    // Samples are dropped and the sensor delay moves, so the IMUs are only reconfigured while nothing is controlled
+    float imu_delay = state == IDLE ? configure_imus(rate_hz, bandwidth_hz, accel_res, gyro_res) : -1;
+    if (imu_delay >= 0) {
+        latency_compensator.setSensorDelay(imu_delay);
+        indicator.beepstring((uint8_t) 0b11100111);
+    } else {
+        indicator.beepstring((uint8_t) 0b10011001);
+    }
+}
+
+void load_imu_calibration() {
+    for (int i = 0; i < imus.count(); i++) {
+        uint32_t addr = FRAM_IMU_ADDR + i * FRAM_IMU_STRIDE;
+        uint32_t imu_magic = 0;
+        fram.read(addr, (uint8_t *) &imu_magic, sizeof imu_magic);
+        if (imu_magic != IMU_CAL_MAGIC)
+            continue;
+
+        IMUCalibration cal;
+        fram.read(addr + sizeof imu_magic, (uint8_t *) &cal, sizeof cal);
+        IMU *device = imus.device(i);
+        device->set_accel_offsets(cal.accel_offset[0], cal.accel_offset[1], cal.accel_offset[2]);
+        device->set_gyro_offsets(cal.gyro_offset[0], cal.gyro_offset[1], cal.gyro_offset[2]);
+        device->setMounting(cal.rotation);
+        device->setLeverArm(cal.lever_x, cal.lever_z);
+    }
+}
+
+void save_imu_calibration() {
+    for (int i = 0; i < imus.count(); i++) {
+        uint32_t addr = FRAM_IMU_ADDR + i * FRAM_IMU_STRIDE;
+        uint32_t imu_magic = IMU_CAL_MAGIC;
+
+        IMUCalibration cal;
+        IMU *device = imus.device(i);
+        device->get_accel_offsets(cal.accel_offset[0], cal.accel_offset[1], cal.accel_offset[2]);
+        device->get_gyro_offsets(cal.gyro_offset[0], cal.gyro_offset[1], cal.gyro_offset[2]);
+        device->getMounting(cal.rotation);
+        device->getLeverArm(cal.lever_x, cal.lever_z);
+
+        fram.writeEnable(true);
+        fram.write(addr, (uint8_t *) &imu_magic, sizeof imu_magic);
+        fram.writeEnable(true);
+        fram.write(addr + sizeof imu_magic, (uint8_t *) &cal, sizeof cal);
+        fram.writeEnable(false);
+    }
+}
+
 int32_t readBack(uint32_t addr, int32_t data) {
     int32_t check = !data;
     int32_t wrapCheck, backup;
@@ -666,7 +1094,7 @@ void retrieveTelemetry(int startAddress) {
     Serial.println("RETRIEVAL BEGINNING");
     float floats[13] = {};
 
-    for (uint16_t i = startAddress; i < 8000 - 53; i += 53) {
+    for (uint16_t i = startAddress; i < FRAM_TELEMETRY_END - TELEMETRY_RECORD_LEN; i += TELEMETRY_RECORD_LEN) {
         Serial.print(fram.read8(i));
         Serial.print("\t");
         fram.read(i + 1, (uint8_t *) floats, sizeof floats);
@@ -685,12 +1113,25 @@ void manual() {
 
 void assist() {
     float er = del_r;
-    torque_motor->setPosition(er);
+    del_cmd += constrain(er - del_cmd, -ASSIST_SLEW_RATE * dt, ASSIST_SLEW_RATE * dt);
+    torque_motor->setPosition(del_cmd);
 }
 
 void automatic() {
-    float u = controller->control(phi, del, dphi, ddel, phi_r, del_r, v, dt);
+    // Control on the state expected when this torque reaches the wheel, not the state already measured
+    BLA::Matrix<4, 1> x_p = latency_compensator.predict(phi, del, dphi, ddel, v, free_running);
+    float u = controller->control(x_p(0), x_p(1), x_p(2), x_p(3), phi_r, del_r, v, dt);
+
+    // Blend from the torque the position loop was applying into the controller output
+    if (transfer_elapsed < TRANSFER_TIME) {
+        float a = transfer_elapsed / TRANSFER_TIME;
+        u = (1 - a) * transfer_u0 + a * u;
+        transfer_elapsed += dt;
+    }
     torque_motor->setTorque(u);
+
+    latency_compensator.measure(u, torque, dt);
+    latency_compensator.record(u, dt);
 }
 
 void fallen() {
@@ -733,6 +1174,7 @@ void assert_manual() {
 void assert_assist() {
     state = ASSIST;
     free_running = false;
+    del_cmd = del;      // Start the position command where the steering is, not at the reference
     torque_motor->setMode(OP_PROFILE_POSITION);
     while (!torque_motor->enableOperation());
 
@@ -744,6 +1186,11 @@ void assert_assist() {
 void assert_automatic() {
     state = AUTO;
     free_running = true;
+    latency_compensator.reset();
+    transfer_u0 = torque;
+    transfer_elapsed = 0;
+    latency_compensator.record(transfer_u0, latency_compensator.getDelay());    // Torque already in flight
+    controller->transfer(transfer_u0, phi, del, dphi, ddel, phi_r, del_r, v);
     torque_motor->setMode(OP_PROFILE_TORQUE);
     while (!torque_motor->enableOperation());
 
@@ -757,6 +1204,7 @@ void assert_fallen() {
     state = FALLEN;
     free_running = false;
     drive_motor->setSpeed(0);
+    abort_homing();
     while (!torque_motor->shutdown());
 
     indicator.setPassiveRGB(RGB_FALLEN_P);
@@ -813,6 +1261,23 @@ void report() {
     delay(20);
 
 
+    // Sent in the settling time the state frame already waits out, so conditions add no stall of their own
+    frame[0] = 16;          // Steering motor condition telemetry frame header
+    frame[1] = sizeof frame;
+
+    *((float *) &(frame[2])) = torque_motor->getCurrent();
+    *((float *) &(frame[6])) = torque_motor->getBusVoltage();
+    *((float *) &(frame[10])) = torque_motor->getDriveTemperature();
+    *((float *) &(frame[14])) = torque_motor->getThermalLoad();
+    *((float *) &(frame[18])) = torque_motor->getTorqueLimit();
+    *((float *) &(frame[22])) = 0;
+    *((float *) &(frame[26])) = millis() / 1000.0f;
+    frame[30] = checksum(frame, 30);
+    frame[31] = 0;
+
+    TELEMETRY.write(frame, 32);
+
+
 //    frame[0] = 14;          // Setpoint telemetry frame header
 //    frame[1] = sizeof frame;
 //
@@ -868,6 +1333,16 @@ void report() {
     Serial.print('\t');
     Serial.print(dheading);
     Serial.print('\t');
+    Serial.print(torque_motor->getCurrent());
+    Serial.print('\t');
+    Serial.print(torque_motor->getBusVoltage());
+    Serial.print('\t');
+    Serial.print(torque_motor->getDriveTemperature());
+    Serial.print('\t');
+    Serial.print(torque_motor->getThermalLoad());
+    Serial.print('\t');
+    Serial.print(torque_motor->getTorqueLimit());
+    Serial.print('\t');
     Serial.print(millis() / 1000.0f);
     Serial.println();
     Serial.flush();
@@ -877,28 +1352,43 @@ void report() {
 
 void find_variances(float &var_v, float &var_a, float &var_phi, float &var_del, float &var_dphi, float &var_ddel) {
     float data[CALIB_SAMP][6];
+    bool v_fresh[CALIB_SAMP];
+    int v_n = 0;
     float v_acc, a_acc, phi_acc, del_acc, dphi_acc, ddel_acc;
     v_acc = a_acc = phi_acc = del_acc = dphi_acc = ddel_acc = 0;
 
-    for (auto &i : data) {
+    for (int k = 0; k < CALIB_SAMP; k++) {
+        float *i = data[k];
+
+        // A speed query takes longer than the sample period, so each sample waits for its own reply and keeps the
+        // speed only if one came back
+        drive_motor->requestSpeed();
+        v_fresh[k] = false;
+        unsigned long sample_start = millis();
+        while (drive_motor->speedPending() || millis() - sample_start < 20) {
+            v_fresh[k] |= drive_motor->update();
+            imus.update();
+        }
+
         i[0] = drive_motor->getSpeed();
-        i[1] = imu.accelX();
-        i[2] = atan2(imu.accelY(), imu.accelZ());
+        i[1] = imus.accelX();
+        i[2] = imus.roll();
         i[3] = torque_motor->getPosition();
-        i[4] = imu.gyroX();
+        i[4] = imus.rollRate();
         i[5] = torque_motor->getVelocity();
 
-        v_acc += i[0];
+        if (v_fresh[k]) {
+            v_acc += i[0];
+            v_n++;
+        }
         a_acc += i[1];
         phi_acc += i[2];
         del_acc += i[3];
         dphi_acc += i[4];
         ddel_acc += i[5];
-
-        delay(20);
     }
 
-    float v_mean = v_acc / CALIB_SAMP;
+    float v_mean = v_n > 0 ? v_acc / v_n : 0;
     float a_mean = a_acc / CALIB_SAMP;
     float phi_mean = phi_acc / CALIB_SAMP;
     float del_mean = del_acc / CALIB_SAMP;
@@ -908,8 +1398,10 @@ void find_variances(float &var_v, float &var_a, float &var_phi, float &var_del,
     float v_var_acc, a_var_acc, phi_var_acc, del_var_acc, dphi_var_acc, ddel_var_acc;
     v_var_acc = a_var_acc = phi_var_acc = del_var_acc = dphi_var_acc = ddel_var_acc = 0;
 
-    for (auto &i : data) {
-        v_var_acc += (i[0] - v_mean) * (i[0] - v_mean);
+    for (int k = 0; k < CALIB_SAMP; k++) {
+        float *i = data[k];
+        if (v_fresh[k])
+            v_var_acc += (i[0] - v_mean) * (i[0] - v_mean);
         a_var_acc += (i[1] - a_mean) * (i[1] - a_mean);
         phi_var_acc += (i[2] - phi_mean) * (i[2] - phi_mean);
         del_var_acc += (i[3] - del_mean) * (i[3] - del_mean);
@@ -917,7 +1409,7 @@ void find_variances(float &var_v, float &var_a, float &var_phi, float &var_del,
         ddel_var_acc += (i[5] - ddel_mean) * (i[5] - ddel_mean);
     }
 
-    var_v = v_var_acc / CALIB_SAMP;
+    var_v = v_n > 1 ? v_var_acc / v_n : velocity_filter.R(0, 0);   // Current one kept if the drive never answered
     var_a = a_var_acc / CALIB_SAMP;
     var_phi = phi_var_acc / CALIB_SAMP;
     var_del = del_var_acc / CALIB_SAMP;
@@ -925,13 +1417,50 @@ void find_variances(float &var_v, float &var_a, float &var_phi, float &var_del,
     var_ddel = ddel_var_acc / CALIB_SAMP;
 }
 
-void home_delta() {
-    torque_motor->calibrate();
-    Serial.println("Successfully calibrated torque motor.");
-    delay(1000);
-    torque_motor->setMode(OP_PROFILE_POSITION);
-    while (!torque_motor->enableOperation());
-    torque_motor->setPosition(0);
-    Serial.println("Succesfully reset to zero position.");
-    delay(3000);
+void update_homing() {
+    if (home_phase == HOME_SEEK) {
+        uint8_t homing_state = torque_motor->updateHoming();
+        if (homing_state == HOMING_RUNNING)
+            return;
+
+        if (homing_state != HOMING_DONE) {
+            Serial.print("Torque motor homing failed with state ");
+            Serial.println(homing_state);
+            home_phase = HOME_FAILED;
+            indicator.beepstring((uint8_t) 0b10011001);
+            return;
+        }
+        Serial.println("Successfully calibrated torque motor.");
+
+        torque_motor->setMode(OP_PROFILE_POSITION);
+        while (!torque_motor->enableOperation());
+        torque_motor->setPosition(0);
+        home_center_start = millis();
+        home_phase = HOME_CENTER;
+    } else if (home_phase == HOME_CENTER) {
+        if (millis() - home_center_start > HOME_MOVE_TIMEOUT_MS) {
+            Serial.println("Timed out resetting to zero position.");
+            while (!torque_motor->shutdown());
+            home_phase = HOME_FAILED;
+            indicator.beepstring((uint8_t) 0b10011001);
+            return;
+        }
+        if (millis() - home_center_start < HOME_SETTLE_MS || !torque_motor->targetReached())
+            return;
+
+        Serial.println("Succesfully reset to zero position.");
+        while (!torque_motor->shutdown());
+        home_phase = HOME_DONE;
+        homing_ok = true;
+    }
+}
+
+void abort_homing() {
+    if (home_phase != HOME_SEEK && home_phase != HOME_CENTER)
+        return;
+
+    torque_motor->abortHoming();
+    while (!torque_motor->shutdown());
+    home_phase = HOME_FAILED;
+    Serial.println("Torque motor homing aborted.");
 }
@@ -0,0 +1,452 @@
+//
+// Host simulator of the Bafang BBS controller on a Linux pseudo-terminal. The simulated controller answers the read and
+// write tags DriveMotor uses at a configurable baud rate, with optional dropped, corrupted and garbage bytes and
+// ignored requests. Its wheel speed follows the throttle voltage through a first order lag.
+//
+// By default the firmware's DriveMotor and BafangCodec are run against it over the pty: start() reads the settings,
+// then a 1 kHz loop queries speed at 5 Hz and regulates toward a target. The run reports start-up time, speed reading
+// rate and age, loop iteration times and error counters. It exits non-zero if any loop iteration took longer than the
+// limit or no speed was ever read, so it can guard DriveMotor's latency and fault recovery.
+// With -p the controller is only served on the pty, whose path is printed, for other programs to connect to.
+//
+// Build: g++ -O2 -std=c++17 -pthread -Ishim -I../../src bafang_sim.cpp ../../src/DriveMotor.cpp
+//            ../../src/BafangCodec.cpp -o bafang_sim
+// Usage: bafang_sim [-b baud] [-t turnaround_ms] [-d drop] [-c corrupt] [-g garbage] [-x silent] [-r seed]
+//                   [-s seconds] [-v target_speed] [-l max_loop_us] [-p]
+//
+
+#include "DriveMotor.h"
+#include "SerialPort.h"
+#include "Timebase.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <poll.h>
+#include <random>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <vector>
+
+#define THROTTLE_PIN        66      // DAC0 on the Due
+#define LOOP_PERIOD_US      1000
+#define SPEED_PERIOD_MS     200     // SPEED_UPDATE_FREQ in main
+#define WHEEL_TAU           1.5     // Speed response to throttle, s
+#define REQUEST_TIMEOUT_MS  100     // Partial requests are dropped after this long without a byte
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    int baud = 1200;
+    int turnaround_ms = 5;
+    double drop = 0, corrupt = 0, garbage = 0, silent = 0;
+    unsigned seed = 1;
+    double seconds = 10;
+    float target = 3;
+    unsigned long max_loop_us = 1000;
+    bool serve = false;
+};
+
+// Timebase on the host clock
+void timebase_begin() {}
+
+uint64_t timebase_micros() {
+    return micros();
+}
+
+uint64_t timebase_cycles() {
+    return timebase_micros() * TIMEBASE_CYCLES_PER_US;
+}
+
+float timebase_elapsed(uint64_t &last_us) {
+    uint64_t now = timebase_micros();
+    float elapsed = (float) (now - last_us) * 1e-6f;
+    last_us = now;
+    return elapsed;
+}
+
+static void make_raw(int fd) {
+    termios tio{};
+    tcgetattr(fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+}
+
+// DriveMotor's end of the pty
+class PtyPort : public SerialPort {
+public:
+    explicit PtyPort(int fd) : fd(fd) {}
+
+    int available() override {
+        int n = 0;
+        return ioctl(fd, FIONREAD, &n) == 0 ? n : 0;
+    }
+
+    int read() override {
+        uint8_t b;
+        return ::read(fd, &b, 1) == 1 ? b : -1;
+    }
+
+    size_t write(uint8_t b) override {
+        return ::write(fd, &b, 1) == 1 ? 1 : 0;
+    }
+
+private:
+    int fd;
+};
+
+class Controller {
+public:
+    Controller(int fd, const Options &options) : fd(fd), opt(options), rng(options.seed) {
+        byte_time = std::chrono::microseconds(10000000 / opt.baud);
+
+        memcpy(&start, "HZXTSZZ6222011\x01\x14", LEN_START);
+        uint8_t b[LEN_BASIC] = {41, 25, 0, 20, 30, 40, 50, 60, 70, 80, 90, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                                100, 100, 0x1C, 0x01};
+        memcpy(&basic, b, LEN_BASIC);
+        uint8_t p[LEN_PEDAL] = {0x03, 0xFF, 0xFF, 10, 3, 4, 10, 25, 8, 20, 20};
+        memcpy(&pedal, p, LEN_PEDAL);
+        uint8_t t[LEN_THROTTLE] = {11, 35, 0, 0xFF, 0xFF, 10};
+        memcpy(&throttle, t, LEN_THROTTLE);
+    }
+
+    void run() {
+        Clock::time_point last = Clock::now(), last_byte = last, line_free = last;
+        while (!stop) {
+            pollfd pfd{fd, POLLIN, 0};
+            bool ready = ::poll(&pfd, 1, 1) > 0;
+
+            Clock::time_point now = Clock::now();
+            updateWheel(std::chrono::duration<double>(now - last).count());
+            last = now;
+
+            if (!ready)
+                continue;
+            uint8_t b;
+            if (::read(fd, &b, 1) != 1)
+                continue;
+
+            // Bytes arrive no faster than the line carries them
+            line_free = std::max(line_free, now) + byte_time;
+            std::this_thread::sleep_until(line_free);
+
+            if (now - last_byte > std::chrono::milliseconds(REQUEST_TIMEOUT_MS))
+                request.clear();
+            last_byte = now;
+
+            request.push_back(b);
+            handle();
+        }
+    }
+
+    std::atomic<bool> stop{false};
+    std::atomic<float> throttle_v{0};
+
+    // Fault and traffic counters
+    std::atomic<unsigned> requests{0}, bad_writes{0}, dropped{0}, corrupted{0}, garbled{0}, ignored{0};
+
+    float speed() const { return wheel_speed; }
+
+private:
+    void handle() {
+        uint8_t command = request[0];
+        if (command != TAG_READ && command != TAG_WRITE) {
+            request.clear();
+            return;
+        }
+        if (request.size() < 2)
+            return;
+
+        uint8_t tag = request[1];
+        uint8_t *data = settings(tag);
+
+        if (command == TAG_READ) {
+            if (tag == TAG_START && request.size() < 5)
+                return;
+            request.clear();
+            requests++;
+
+            if (tag == TAG_RPM) {
+                auto rpm = (uint16_t) lround(wheel_speed * 60 / WHEEL_CIRCUMFERENCE);
+                std::vector<uint8_t> reply = {(uint8_t) (rpm >> 8), (uint8_t) rpm};
+                reply.push_back((uint8_t) (TAG_RPM + reply[0] + reply[1]));
+                send(reply);
+            } else if (data != nullptr) {
+                int len = length(tag);
+                std::vector<uint8_t> reply = {tag, (uint8_t) len};
+                reply.insert(reply.end(), data, data + len);
+                long sum = 0;
+                for (uint8_t r : reply)
+                    sum += r;
+                reply.push_back((uint8_t) sum);
+                send(reply);
+            }
+            return;
+        }
+
+        if (tag == TAG_PAS_NUM) {
+            if (request.size() < 4)
+                return;
+            requests++;
+            if ((uint8_t) (TAG_WRITE + TAG_PAS_NUM + request[2]) == request[3])
+                pas_code = request[2];
+            else
+                bad_writes++;
+            request.clear();
+            return;
+        }
+
+        if (data == nullptr) {
+            request.clear();
+            return;
+        }
+        if (request.size() < 3)
+            return;
+        int len = length(tag);
+        if ((size_t) len + 4 > request.size())
+            return;
+
+        requests++;
+        long sum = 0;
+        for (int i = 1; i < len + 3; i++)
+            sum += request[i];
+        if (request[2] == len && (uint8_t) sum == request[len + 3]) {
+            memcpy(data, &request[3], len);
+            send({tag, (uint8_t) len});
+        } else {
+            bad_writes++;
+        }
+        request.clear();
+    }
+
+    uint8_t *settings(uint8_t tag) {
+        switch (tag) {
+            case TAG_START:
+                return (uint8_t *) &start;
+            case TAG_BASIC:
+                return (uint8_t *) &basic;
+            case TAG_PEDAL:
+                return (uint8_t *) &pedal;
+            case TAG_THROTTLE:
+                return (uint8_t *) &throttle;
+            default:
+                return nullptr;
+        }
+    }
+
+    static int length(uint8_t tag) {
+        switch (tag) {
+            case TAG_START:
+                return LEN_START;
+            case TAG_BASIC:
+                return LEN_BASIC;
+            case TAG_PEDAL:
+                return LEN_PEDAL;
+            default:
+                return LEN_THROTTLE;
+        }
+    }
+
+    bool chance(double p) {
+        return p > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < p;
+    }
+
+    void send(const std::vector<uint8_t> &reply) {
+        if (chance(opt.silent)) {
+            ignored++;
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(opt.turnaround_ms));
+
+        if (chance(opt.garbage)) {
+            garbled++;
+            sendByte((uint8_t) rng());
+        }
+        for (uint8_t b : reply) {
+            if (chance(opt.drop)) {
+                dropped++;
+                std::this_thread::sleep_for(byte_time);
+                continue;
+            }
+            if (chance(opt.corrupt)) {
+                corrupted++;
+                b ^= (uint8_t) (1U << (rng() % 8));
+            }
+            sendByte(b);
+        }
+    }
+
+    void sendByte(uint8_t b) {
+        std::this_thread::sleep_for(byte_time);
+        if (::write(fd, &b, 1) != 1)
+            perror("write");
+    }
+
+    void updateWheel(double dt) {
+        float v = throttle_v;
+        float target = 0;
+        float start_v = throttle.start_voltage * 0.1f, end_v = throttle.end_voltage * 0.1f;
+        if (pas_code != 0 && v >= start_v)
+            target = (float) MAX_SPEED * std::min((v - start_v) / (end_v - start_v), 1.0f);
+        float speed = wheel_speed;
+        wheel_speed = speed + (float) ((target - speed) * dt / WHEEL_TAU);
+    }
+
+    int fd;
+    Options opt;
+    std::mt19937 rng;
+    std::chrono::microseconds byte_time{};
+
+    std::vector<uint8_t> request;
+    BafangStart start{};
+    BafangBasic basic{};
+    BafangPedal pedal{};
+    BafangThrottle throttle{};
+    uint8_t pas_code = 0;
+    std::atomic<float> wheel_speed{0};
+};
+
+static double percentile(std::vector<unsigned long> v, double p) {
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return (double) v[std::min(v.size() - 1, (size_t) (p * (double) v.size()))];
+}
+
+static int drive(Controller &controller, int fd, const Options &opt) {
+    PtyPort port(fd);
+    DriveMotor motor(THROTTLE_PIN, &port);
+
+    unsigned long start_ms = millis();
+    motor.start();
+    unsigned long start_time = millis() - start_ms;
+
+    motor.setSpeed(opt.target);
+
+    std::vector<unsigned long> loop_us;
+    std::vector<double> ages;
+    unsigned long readings = 0, max_loop = 0;
+    float v = 0;
+
+    uint64_t loop_time = timebase_micros();
+    unsigned long last_request = 0;
+    Clock::time_point next = Clock::now();
+    Clock::time_point end = next + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(opt.seconds));
+    while (Clock::now() < end) {
+        unsigned long t0 = micros();
+        float dt = timebase_elapsed(loop_time);
+
+        if (millis() - last_request >= SPEED_PERIOD_MS) {
+            motor.requestSpeed();
+            last_request = millis();
+        }
+        if (motor.update()) {
+            readings++;
+            ages.push_back((double) (timebase_micros() - motor.getSpeedTime()) * 1e-3);
+            v = motor.getSpeed();
+        }
+        motor.regulate(v, dt);
+        controller.throttle_v = motor.getThrottleVoltage();
+
+        unsigned long took = micros() - t0;
+        loop_us.push_back(took);
+        max_loop = std::max(max_loop, took);
+
+        next += std::chrono::microseconds(LOOP_PERIOD_US);
+        std::this_thread::sleep_until(next);
+    }
+    motor.setSpeed(0);
+
+    double mean_age = 0, max_age = 0;
+    for (double a : ages) {
+        mean_age += a / (double) ages.size();
+        max_age = std::max(max_age, a);
+    }
+
+    const BafangCodec &codec = motor.getCodec();
+    printf("\nstart:      %lu ms (budget per read %lu ms)\n", start_time, BafangCodec::transactionTime(BAFANG_BASIC));
+    printf("readings:   %lu, %.2f Hz, %lu queries dropped\n", readings, (double) readings / opt.seconds,
+           motor.getSpeedFailures());
+    printf("age:        mean %.1f ms, max %.1f ms\n", mean_age, max_age);
+    printf("loop:       p50 %.0f us, p99 %.0f us, max %lu us\n", percentile(loop_us, 0.5), percentile(loop_us, 0.99),
+           max_loop);
+    printf("codec:      %u checksum errors, %u timeouts, %u bytes skipped\n", codec.getChecksumErrors(),
+           codec.getTimeouts(), codec.getSkipped());
+    printf("controller: %u requests, %u bad writes, %u dropped, %u corrupted, %u garbage, %u ignored\n",
+           controller.requests.load(), controller.bad_writes.load(), controller.dropped.load(),
+           controller.corrupted.load(), controller.garbled.load(), controller.ignored.load());
+    printf("speed:      %.2f m/s measured, %.2f m/s simulated, %.2f m/s target, throttle %.2f V\n", v,
+           controller.speed(), opt.target, motor.getThrottleVoltage());
+
+    int status = 0;
+    if (max_loop > opt.max_loop_us) {
+        printf("FAIL: loop iteration took %lu us, limit %lu us\n", max_loop, opt.max_loop_us);
+        status = 1;
+    }
+    if (readings == 0) {
+        printf("FAIL: no speed reading\n");
+        status = 1;
+    }
+    return status;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    int c;
+    while ((c = getopt(argc, argv, "b:t:d:c:g:x:r:s:v:l:p")) != -1) {
+        switch (c) {
+            case 'b': opt.baud = atoi(optarg); break;
+            case 't': opt.turnaround_ms = atoi(optarg); break;
+            case 'd': opt.drop = atof(optarg); break;
+            case 'c': opt.corrupt = atof(optarg); break;
+            case 'g': opt.garbage = atof(optarg); break;
+            case 'x': opt.silent = atof(optarg); break;
+            case 'r': opt.seed = (unsigned) atoi(optarg); break;
+            case 's': opt.seconds = atof(optarg); break;
+            case 'v': opt.target = (float) atof(optarg); break;
+            case 'l': opt.max_loop_us = strtoul(optarg, nullptr, 10); break;
+            case 'p': opt.serve = true; break;
+            default:
+                fprintf(stderr, "Usage: %s [-b baud] [-t turnaround_ms] [-d drop] [-c corrupt] [-g garbage] "
+                                "[-x silent] [-r seed] [-s seconds] [-v target_speed] [-l max_loop_us] [-p]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("pty");
+        return 2;
+    }
+    make_raw(master);
+    const char *slave_name = ptsname(master);
+
+    Controller controller(master, opt);
+    std::thread sim(&Controller::run, &controller);
+
+    int status = 0;
+    if (opt.serve) {
+        printf("Bafang controller on %s\n", slave_name);
+        fflush(stdout);
+        sim.join();
+        return 0;
+    } else {
+        int slave = open(slave_name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (slave < 0) {
+            perror(slave_name);
+            return 2;
+        }
+        make_raw(slave);
+        status = drive(controller, slave, opt);
+        close(slave);
+    }
+
+    controller.stop = true;
+    sim.join();
+    close(master);
+    return status;
+}
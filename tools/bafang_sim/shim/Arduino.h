@@ -0,0 +1,87 @@
+//
+// Just enough of the Arduino core for DriveMotor and BafangCodec to build and run on a Linux host
+//
+
+#ifndef AUTOCYCLE_STABILITY_FIRMWARE_HOST_ARDUINO_H
+#define AUTOCYCLE_STABILITY_FIRMWARE_HOST_ARDUINO_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+typedef uint8_t byte;
+
+#define PI          3.1415926535897932384626433832795
+#define OUTPUT      0x1
+#define F_CPU       84000000L
+
+template<class T, class L, class H>
+T constrain(T x, L low, H high) { return x < low ? (T) low : (x > high ? (T) high : x); }
+
+template<class A, class B>
+auto min(A a, B b) -> decltype(a + b) { return a < b ? a : b; }
+
+template<class A, class B>
+auto max(A a, B b) -> decltype(a + b) { return a > b ? a : b; }
+
+inline const std::chrono::steady_clock::time_point host_boot = std::chrono::steady_clock::now();
+
+inline unsigned long micros() {
+    return (unsigned long) std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - host_boot).count();
+}
+
+inline unsigned long millis() {
+    return micros() / 1000;
+}
+
+inline void delay(unsigned long ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+// Last value written to each analog output
+inline uint32_t host_analog[128];
+
+inline void pinMode(int, int) {}
+
+inline void analogWrite(int pin, uint32_t value) {
+    host_analog[pin & 127] = value;
+}
+
+class Print {
+public:
+    virtual size_t write(uint8_t b) = 0;
+
+    size_t print(const char *s) { return printf("%s", s); }
+    size_t print(char c) { return printf("%c", c); }
+    size_t print(int n) { return printf("%d", n); }
+    size_t print(unsigned int n) { return printf("%u", n); }
+    size_t print(long n) { return printf("%ld", n); }
+    size_t print(unsigned long n) { return printf("%lu", n); }
+    size_t print(double x) { return printf("%.2f", x); }
+
+    template<class T>
+    size_t println(T x) { return print(x) + println(); }
+    size_t println() { return printf("\n"); }
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+};
+
+// Serial writes to stdout and never has input
+class HostSerial : public Stream {
+public:
+    size_t write(uint8_t b) override { return fputc(b, stdout) == EOF ? 0 : 1; }
+    int available() override { return 0; }
+    int read() override { return -1; }
+};
+
+inline HostSerial Serial;
+
+
+#endif //AUTOCYCLE_STABILITY_FIRMWARE_HOST_ARDUINO_H
@@ -0,0 +1,372 @@
+//
+// Host tool for raw IMU vibration captures, as streamed over Serial by the firmware's capture mode ('v'). Each log
+// may hold several captures between "CAPTURE BEGINNING" and "CAPTURE END". For every capture it writes the Welch
+// power spectral density of each axis and a spectrogram, and across all captures of the same rate the mean PSD.
+// Captures are processed in parallel.
+//
+// Build: g++ -O2 -std=c++17 -pthread imu_psd.cpp -o imu_psd
+// Usage: imu_psd [-n nperseg] [-s spectrogram_seg] [-j threads] [-o out_dir] log...
+//
+// Outputs are CSV, accelerations in (m/s^2)^2/Hz and rotation rates in (rad/s)^2/Hz, one-sided:
+//   <log>.<k>.psd.csv           freq, a_x, a_y, a_z, g_x, g_y, g_z
+//   <log>.<k>.spectrogram.csv   time, freq, a_x, ... g_z, in dB
+//   psd_mean_<rate>.csv         mean of the capture PSDs at that rate
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <complex>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define GRAV        9.8
+#define RAW_RANGE   32767.0
+#define AXES        6
+
+static const char *AXIS_NAMES[AXES] = {"a_x", "a_y", "a_z", "g_x", "g_y", "g_z"};
+
+struct Capture {
+    std::string name;                       // Output path prefix
+    double rate = 0;                        // Hz
+    std::vector<double> data[AXES];         // Physical units
+    int gaps = 0;                           // Samples more than 1.5 periods apart
+};
+
+struct Spectrum {
+    std::vector<double> freq;
+    std::vector<double> psd[AXES];
+};
+
+struct Options {
+    int nperseg = 256;
+    int spec_seg = 128;
+    unsigned threads = std::max(1U, std::thread::hardware_concurrency());
+    std::string out_dir;
+    std::vector<std::string> logs;
+};
+
+
+// In place iterative radix-2 FFT, n a power of two
+static void fft(std::vector<std::complex<double>> &x) {
+    size_t n = x.size();
+    for (size_t i = 1, j = 0; i < n; i++) {
+        size_t bit = n >> 1U;
+        for (; j & bit; bit >>= 1U)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+            std::swap(x[i], x[j]);
+    }
+    for (size_t len = 2; len <= n; len <<= 1U) {
+        double ang = -2 * M_PI / (double) len;
+        std::complex<double> wl(cos(ang), sin(ang));
+        for (size_t i = 0; i < n; i += len) {
+            std::complex<double> w(1);
+            for (size_t k = 0; k < len / 2; k++) {
+                std::complex<double> u = x[i + k], v = x[i + k + len / 2] * w;
+                x[i + k] = u + v;
+                x[i + k + len / 2] = u - v;
+                w *= wl;
+            }
+        }
+    }
+}
+
+static std::vector<double> hann(int n) {
+    std::vector<double> w(n);
+    for (int i = 0; i < n; i++)
+        w[i] = 0.5 - 0.5 * cos(2 * M_PI * i / n);
+    return w;
+}
+
+// One-sided periodogram of x[start, start + n) with window w, mean removed, scaled to density
+static std::vector<double> periodogram(const std::vector<double> &x, size_t start, const std::vector<double> &w,
+                                       double rate) {
+    size_t n = w.size();
+    double mean = 0;
+    for (size_t i = 0; i < n; i++)
+        mean += x[start + i];
+    mean /= (double) n;
+
+    double w_power = 0;
+    std::vector<std::complex<double>> buf(n);
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = (x[start + i] - mean) * w[i];
+        w_power += w[i] * w[i];
+    }
+    fft(buf);
+
+    std::vector<double> p(n / 2 + 1);
+    for (size_t k = 0; k <= n / 2; k++) {
+        p[k] = std::norm(buf[k]) / (rate * w_power);
+        if (k != 0 && k != n / 2)
+            p[k] *= 2;
+    }
+    return p;
+}
+
+// Welch estimate with 50% overlapping Hann segments
+static Spectrum welch(const Capture &c, int nperseg) {
+    Spectrum s;
+    std::vector<double> w = hann(nperseg);
+    size_t step = nperseg / 2;
+    size_t len = c.data[0].size();
+
+    for (int k = 0; k <= nperseg / 2; k++)
+        s.freq.push_back(k * c.rate / nperseg);
+
+    for (int a = 0; a < AXES; a++) {
+        s.psd[a].assign(nperseg / 2 + 1, 0);
+        int segments = 0;
+        for (size_t start = 0; start + nperseg <= len; start += step, segments++) {
+            std::vector<double> p = periodogram(c.data[a], start, w, c.rate);
+            for (size_t k = 0; k < p.size(); k++)
+                s.psd[a][k] += p[k];
+        }
+        for (double &v : s.psd[a])
+            v /= std::max(segments, 1);
+    }
+    return s;
+}
+
+static bool write_psd(const std::string &path, const Spectrum &s) {
+    std::ofstream out(path);
+    if (!out)
+        return false;
+
+    out << "freq";
+    for (const char *name : AXIS_NAMES)
+        out << ',' << name;
+    out << '\n';
+    for (size_t k = 0; k < s.freq.size(); k++) {
+        out << s.freq[k];
+        for (const auto &p : s.psd)
+            out << ',' << p[k];
+        out << '\n';
+    }
+    return true;
+}
+
+static bool write_spectrogram(const std::string &path, const Capture &c, int seg) {
+    std::ofstream out(path);
+    if (!out)
+        return false;
+
+    out << "time,freq";
+    for (const char *name : AXIS_NAMES)
+        out << ',' << name;
+    out << '\n';
+
+    std::vector<double> w = hann(seg);
+    size_t step = seg / 2;
+    for (size_t start = 0; start + seg <= c.data[0].size(); start += step) {
+        std::vector<double> p[AXES];
+        for (int a = 0; a < AXES; a++)
+            p[a] = periodogram(c.data[a], start, w, c.rate);
+
+        double t = (start + seg / 2.0) / c.rate;
+        for (int k = 0; k <= seg / 2; k++) {
+            out << t << ',' << k * c.rate / seg;
+            for (const auto &pa : p)
+                out << ',' << 10 * log10(pa[k] + 1e-30);
+            out << '\n';
+        }
+    }
+    return true;
+}
+
+// Split a log into captures, converting raw counts with the ranges from each capture's header
+static std::vector<Capture> parse_log(const std::string &path, const std::string &out_prefix) {
+    std::vector<Capture> captures;
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "cannot open " << path << '\n';
+        return captures;
+    }
+
+    std::string line;
+    bool inside = false;
+    double accel_scale = 0, gyro_scale = 0;
+    long last_t = -1;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+
+        if (line == "CAPTURE BEGINNING") {
+            inside = true;
+            captures.emplace_back();
+            captures.back().name = out_prefix + "." + std::to_string(captures.size() - 1);
+            last_t = -1;
+            continue;
+        }
+        if (!inside)
+            continue;
+        if (line == "CAPTURE END") {
+            inside = false;
+            continue;
+        }
+
+        Capture &c = captures.back();
+        std::istringstream fields(line);
+        if (line.compare(0, 4, "rate") == 0) {
+            std::string key;
+            double accel_fsr = 0, gyro_fsr = 0;
+            while (fields >> key) {
+                if (key == "rate")
+                    fields >> c.rate;
+                else if (key == "accel_fsr")
+                    fields >> accel_fsr;
+                else if (key == "gyro_fsr")
+                    fields >> gyro_fsr;
+                else
+                    fields >> key;
+            }
+            accel_scale = GRAV * accel_fsr / RAW_RANGE;
+            gyro_scale = gyro_fsr / RAW_RANGE * M_PI / 180;
+            continue;
+        }
+
+        long t;
+        double raw[AXES];
+        if (!(fields >> t))
+            continue;
+        bool complete = true;
+        for (double &r : raw)
+            complete = complete && (fields >> r);
+        if (!complete)
+            continue;
+
+        if (last_t >= 0 && c.rate > 0 && (double) (t - last_t) > 1.5e6 / c.rate)
+            c.gaps++;
+        last_t = t;
+        for (int a = 0; a < AXES; a++)
+            c.data[a].push_back(raw[a] * (a < 3 ? accel_scale : gyro_scale));
+    }
+
+    // Drop captures cut off or without a header
+    captures.erase(std::remove_if(captures.begin(), captures.end(), [](const Capture &c) {
+        return c.rate <= 0 || c.data[0].empty();
+    }), captures.end());
+    return captures;
+}
+
+static bool power_of_two(int n) {
+    return n > 1 && (n & (n - 1)) == 0;
+}
+
+static bool parse_options(int argc, char **argv, Options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if ((arg == "-n" || arg == "-s" || arg == "-j" || arg == "-o") && i + 1 < argc) {
+            std::string val = argv[++i];
+            if (arg == "-n")
+                opt.nperseg = atoi(val.c_str());
+            else if (arg == "-s")
+                opt.spec_seg = atoi(val.c_str());
+            else if (arg == "-j")
+                opt.threads = std::max(1, atoi(val.c_str()));
+            else
+                opt.out_dir = val;
+        } else if (!arg.empty() && arg[0] == '-') {
+            return false;
+        } else {
+            opt.logs.push_back(arg);
+        }
+    }
+    return !opt.logs.empty() && power_of_two(opt.nperseg) && power_of_two(opt.spec_seg);
+}
+
+static std::string output_prefix(const Options &opt, const std::string &log) {
+    if (opt.out_dir.empty())
+        return log;
+    size_t slash = log.find_last_of('/');
+    return opt.out_dir + "/" + (slash == std::string::npos ? log : log.substr(slash + 1));
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parse_options(argc, argv, opt)) {
+        std::cerr << "usage: imu_psd [-n nperseg] [-s spectrogram_seg] [-j threads] [-o out_dir] log...\n"
+                     "       segment lengths must be powers of two\n";
+        return 2;
+    }
+
+    std::vector<Capture> captures;
+    for (const std::string &log : opt.logs) {
+        std::vector<Capture> found = parse_log(log, output_prefix(opt, log));
+        for (Capture &c : found)
+            captures.push_back(std::move(c));
+    }
+    if (captures.empty()) {
+        std::cerr << "no complete captures found\n";
+        return 1;
+    }
+
+    // Workers take captures off a shared index, results go to per-capture slots so only the log needs a lock
+    std::vector<Spectrum> spectra(captures.size());
+    std::vector<bool> valid(captures.size(), false);
+    std::atomic<size_t> next(0);
+    std::mutex log_mutex;
+    auto worker = [&]() {
+        for (size_t i = next++; i < captures.size(); i = next++) {
+            const Capture &c = captures[i];
+            if (c.data[0].size() < (size_t) opt.nperseg) {
+                std::lock_guard<std::mutex> lock(log_mutex);
+                std::cerr << c.name << ": " << c.data[0].size() << " samples, shorter than one segment\n";
+                continue;
+            }
+
+            spectra[i] = welch(c, opt.nperseg);
+            bool ok = write_psd(c.name + ".psd.csv", spectra[i]) &&
+                      write_spectrogram(c.name + ".spectrogram.csv", c, opt.spec_seg);
+            valid[i] = true;
+
+            std::lock_guard<std::mutex> lock(log_mutex);
+            std::cout << c.name << ": " << c.data[0].size() << " samples at " << c.rate << " Hz";
+            if (c.gaps)
+                std::cout << ", " << c.gaps << " gaps";
+            if (!ok)
+                std::cout << ", failed to write output";
+            std::cout << '\n';
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < std::min<size_t>(opt.threads, captures.size()); t++)
+        pool.emplace_back(worker);
+    for (std::thread &t : pool)
+        t.join();
+
+    // Average PSDs across captures sharing a rate, the bins only line up then
+    std::map<double, std::vector<size_t>> by_rate;
+    for (size_t i = 0; i < captures.size(); i++)
+        if (valid[i])
+            by_rate[captures[i].rate].push_back(i);
+    for (const auto &group : by_rate) {
+        Spectrum mean = spectra[group.second[0]];
+        for (size_t g = 1; g < group.second.size(); g++)
+            for (int a = 0; a < AXES; a++)
+                for (size_t k = 0; k < mean.freq.size(); k++)
+                    mean.psd[a][k] += spectra[group.second[g]].psd[a][k];
+        for (auto &p : mean.psd)
+            for (double &v : p)
+                v /= (double) group.second.size();
+
+        char name[64];
+        snprintf(name, sizeof name, "psd_mean_%g.csv", group.first);
+        std::string path = opt.out_dir.empty() ? name : opt.out_dir + "/" + name;
+        if (write_psd(path, mean))
+            std::cout << path << ": mean of " << group.second.size() << " captures\n";
+    }
+
+    return 0;
+}
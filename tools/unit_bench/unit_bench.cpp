@@ -0,0 +1,135 @@
+//
+// Host microbenchmark of TorqueMotor's unit conversions: the expressions the getters and setters used to evaluate on
+// every call, with their chained divisions and double literals, against the folded single-precision scale factors in
+// TorqueUnits.h. It reports the time per conversion and per control loop, where AUTO with friction compensation does
+// one torque set, two position and two velocity reads and one torque read.
+//
+// A host FPU does double arithmetic in hardware, so the saving shown here is a lower bound on the Due, whose M3 has no
+// FPU at all and runs doubles and float divisions as library calls. Building with -DUNIT_BENCH_VERIFY also checks the
+// two forms agree to within a drive unit on the setter and 1e-5 on the getters.
+//
+// Build: g++ -O2 -std=c++17 -I../../src unit_bench.cpp -o unit_bench
+// Usage: unit_bench [iterations]
+//
+
+#include "TorqueUnits.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#define SAMPLES         4096
+#define LOOP_SETS       1
+#define LOOP_POSITIONS  2
+#define LOOP_VELOCITIES 2
+#define LOOP_TORQUES    1
+
+using Clock = std::chrono::steady_clock;
+
+static const float position_offset = 0.1f;
+
+// The conversions as they were written before the constants were folded
+static int16_t legacy_set_torque(float torque) {
+    return (int16_t) (-1.0f * 1000.0 * torque / GEARING / EFFICIENCY / RATED_TORQUE_NM);
+}
+
+static float legacy_get_torque(int16_t torque_thou) {
+    return -1.0f * (1 / 1000.0f) * GEARING * EFFICIENCY * RATED_TORQUE_NM * (float) torque_thou;
+}
+
+static float legacy_get_velocity(int32_t velocity) {
+    return -1.0f * velocity / 100.0f / GEARING;
+}
+
+static float legacy_get_position(int32_t position) {
+    return -1.0f * position / 100.0f / GEARING + position_offset;
+}
+
+static int16_t folded_set_torque(float torque) {
+    return (int16_t) (TORQUE_THOU_PER_NM * torque);
+}
+
+static float folded_get_torque(int16_t torque_thou) {
+    return NM_PER_TORQUE_THOU * (float) torque_thou;
+}
+
+static float folded_get_velocity(int32_t velocity) {
+    return RAD_S_PER_VELOCITY_UNIT * (float) velocity;
+}
+
+static float folded_get_position(int32_t position) {
+    return RAD_PER_POSITION_UNIT * (float) position + position_offset;
+}
+
+// Keeps the compiler from discarding or hoisting the conversions
+static volatile float sink;
+
+// Results go to memory rather than a running sum, so each conversion's own cost is timed and not an add chain
+template<class In, class F>
+static double time_ns(const std::vector<In> &in, long iterations, F convert) {
+    std::vector<float> out(in.size());
+    Clock::time_point start = Clock::now();
+    for (long n = 0; n < iterations; n++) {
+        for (size_t i = 0; i < in.size(); i++)
+            out[i] = (float) convert(in[i]);
+        sink = out[n % out.size()];
+    }
+    double elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    return elapsed / ((double) iterations * (double) in.size());
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 2000;
+
+    std::mt19937 rng(1);
+    std::vector<float> torques(SAMPLES);
+    std::vector<int16_t> torques_raw(SAMPLES);
+    std::vector<int32_t> motion_raw(SAMPLES);
+    for (int i = 0; i < SAMPLES; i++) {
+        torques[i] = std::uniform_real_distribution<float>(-10, 10)(rng);
+        torques_raw[i] = (int16_t) std::uniform_int_distribution<int>(-1000, 1000)(rng);
+        motion_raw[i] = std::uniform_int_distribution<int32_t>(-200000, 200000)(rng);
+    }
+
+#ifdef UNIT_BENCH_VERIFY
+    for (int i = 0; i < SAMPLES; i++) {
+        if (abs(legacy_set_torque(torques[i]) - folded_set_torque(torques[i])) > 1 ||
+            fabsf(legacy_get_torque(torques_raw[i]) - folded_get_torque(torques_raw[i])) > 1e-5f ||
+            fabsf(legacy_get_velocity(motion_raw[i]) - folded_get_velocity(motion_raw[i])) > 1e-5f ||
+            fabsf(legacy_get_position(motion_raw[i]) - folded_get_position(motion_raw[i])) > 1e-5f) {
+            printf("Mismatch at sample %d\n", i);
+            return 1;
+        }
+    }
+#endif
+
+    struct {
+        const char *name;
+        int per_loop;
+        double legacy, folded;
+    } rows[] = {
+            {"setTorque",   LOOP_SETS,       time_ns(torques, iterations, legacy_set_torque),
+                                             time_ns(torques, iterations, folded_set_torque)},
+            {"getTorque",   LOOP_TORQUES,    time_ns(torques_raw, iterations, legacy_get_torque),
+                                             time_ns(torques_raw, iterations, folded_get_torque)},
+            {"getVelocity", LOOP_VELOCITIES, time_ns(motion_raw, iterations, legacy_get_velocity),
+                                             time_ns(motion_raw, iterations, folded_get_velocity)},
+            {"getPosition", LOOP_POSITIONS,  time_ns(motion_raw, iterations, legacy_get_position),
+                                             time_ns(motion_raw, iterations, folded_get_position)},
+    };
+
+    double legacy_loop = 0, folded_loop = 0;
+    printf("%-12s %10s %10s %8s\n", "conversion", "legacy ns", "folded ns", "speedup");
+    for (auto &row : rows) {
+        printf("%-12s %10.2f %10.2f %7.1fx\n", row.name, row.legacy, row.folded, row.legacy / row.folded);
+        legacy_loop += row.per_loop * row.legacy;
+        folded_loop += row.per_loop * row.folded;
+    }
+    printf("%-12s %10.2f %10.2f %7.1fx\n", "per loop", legacy_loop, folded_loop, legacy_loop / folded_loop);
+
+    return 0;
+}